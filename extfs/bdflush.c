@@ -0,0 +1,173 @@
+/* This file handles periodic write back of dirty state.
+ *
+ * A kqueue timer wakes the main loop every BDFLUSH_INTERVAL_SECS. Delayed
+ * allocation buffers older than the expire time are allocated and copied
+ * into the block cache, dirty inodes are copied into their inode-table
+ * blocks, then blocks in the
+ * dirty block table that have been dirty for longer than the expire time
+ * are written back, as are the least recently dirtied blocks while more
+ * than the dirty ratio of the table is in use. The blocks are sorted by
+ * block number and physically contiguous ones are written together. The
+ * dirty blocks of the group descriptor table and the superblock are
+ * written last if they have changed.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include <time.h>
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Start the periodic flusher's timer
+ *
+ * Called once the kqueue has been created.
+ */
+void init_bdflush(void)
+{
+  struct kevent ev;
+
+  EV_SET(&ev, BDFLUSH_TIMER_ID, EVFILT_TIMER, EV_ADD | EV_ENABLE, 0,
+         BDFLUSH_INTERVAL_SECS * 1000, 0);
+
+  if (kevent(kq, &ev, 1, NULL, 0, NULL) != 0) {
+    log_warn("extfs: can't start flusher timer");
+  }
+}
+
+
+/* @brief   Write back dirty inodes, blocks and group descriptors
+ *
+ * @param   all, true to write back everything, false to write back only
+ *          expired blocks and enough others to get below the dirty ratio
+ */
+void bdflush(bool all)
+{
+  struct dirty_block *db;
+  time_t now;
+  uint32_t limit;
+  uint32_t over;
+  uint32_t n;
+
+  if (config.read_only) {
+    return;
+  }
+  
+  now = time(NULL);
+  flush_expired_delalloc(now);
+  flush_dirty_inodes();
+
+  limit = NR_DIRTY_BLOCKS * config.dirty_ratio / 100;
+  over = (nr_dirty_blocks > limit) ? nr_dirty_blocks - limit : 0;
+  n = 0;
+
+  // The list runs from least to most recently dirtied
+  for (db = LIST_HEAD(&dirty_block_list); db != NULL; db = LIST_NEXT(db, lru_link)) {
+    if (all || n < over || now - db->dirtied >= config.dirty_expire_secs) {
+      bdflush_blocks[n++] = db->block;
+    }
+  }
+
+  writeback_blocks(n);
+
+  if (sb_group_descriptors_dirty || sb_superblock_dirty) {
+    write_group_descriptors();
+    write_superblock();
+  }
+}
+
+
+/* @brief   Write back the least recently dirtied blocks
+ *
+ * @param   nblocks, most blocks to write back
+ * @return  number of blocks written back
+ *
+ * Used to bring the amount of dirty data down between messages. If there
+ * are too few blocks in the dirty block table, the delayed blocks of the
+ * least recently written file are allocated first so that they can be
+ * written back on the next call.
+ */
+uint32_t writeback_oldest(uint32_t nblocks)
+{
+  struct dirty_block *db;
+  struct delalloc_block *dab;
+  uint32_t n = 0;
+
+  if (config.read_only) {
+    return 0;
+  }
+  
+  if (nr_dirty_blocks < nblocks && (dab = LIST_HEAD(&delalloc_lru_list)) != NULL) {
+    if (flush_delalloc(find_inode(dab->ino)) != 0) {
+      log_warn("extfs: can't flush delayed blocks of ino:%u", (uint32_t)dab->ino);
+    }
+  }
+  
+  for (db = LIST_HEAD(&dirty_block_list); db != NULL && n < nblocks; db = LIST_NEXT(db, lru_link)) {
+    bdflush_blocks[n++] = db->block;
+  }
+
+  writeback_blocks(n);
+  return n;
+}
+
+
+/* @brief   Write back every dirty metadata block of one type
+ *
+ * @param   type, DB_BITMAP, DB_INDIRECT, DB_INODE_TABLE or DB_DIRECTORY
+ */
+void writeback_metadata(int type)
+{
+  struct dirty_block *db;
+  uint32_t n = 0;
+
+  for (db = LIST_HEAD(&dirty_block_list); db != NULL; db = LIST_NEXT(db, lru_link)) {
+    if (db->type == type) {
+      bdflush_blocks[n++] = db->block;
+    }
+  }
+
+  writeback_blocks(n);
+}
+
+
+/* @brief   Write back blocks collected in bdflush_blocks
+ *
+ * @param   n, number of blocks collected
+ *
+ * The blocks are sorted so that physically contiguous ones can be written
+ * together.
+ */
+void writeback_blocks(uint32_t n)
+{
+  uint32_t run;
+  uint32_t max_run;
+
+  qsort(bdflush_blocks, n, sizeof (block_t), cmp_block);
+  max_run = COALESCE_BUF_SZ / sb_block_size;
+
+  for (uint32_t t = 0; t < n; t += run) {
+    for (run = 1; t + run < n && run < max_run; run++) {
+      if (bdflush_blocks[t + run] != bdflush_blocks[t] + run) {
+        break;
+      }
+    }
+
+    writeback_dirty_run(&bdflush_blocks[t], run);
+  }
+}
+
+
+/* @brief   Compare two block numbers for qsort()
+ *
+ */
+int cmp_block(const void *a, const void *b)
+{
+  block_t ba = *(const block_t *)a;
+  block_t bb = *(const block_t *)b;
+
+  return (ba > bb) - (ba < bb);
+}
@@ -1,7 +1,11 @@
 /* This file manages bits in block bitmaps
+ *
+ * Searches skip over full parts of a bitmap 128 bits at a time with NEON
+ * where it is available, otherwise 64 bits at a time, and then use
+ * count-trailing-zeros to locate a clear bit within a word.
  *
  * Created (CheviotOS Filesystem Handler based)
- *   December 2023 (Marven Gilhespie) 
+ *   December 2023 (Marven Gilhespie)
  */
 
 #define LOG_LEVEL_WARN
@@ -9,33 +13,290 @@
 #include "ext2.h"
 #include "globals.h"
 
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
-/* @brief   Allocate and set a bit in a bitmap
+
+/* @brief   Get 64 bits of a bitmap, with bits at or beyond max_bits set
  *
- * @param   bitmap, bitmap to allocate and set a bit within
- * @param   max_bits, maximum size of the bitmap to search
- * @param   word, word in bitmap to start search from
- * @return  return index of bit allocated or -1 on error
- */ 
-int alloc_bit(uint32_t *bitmap, uint32_t max_bits, uint32_t start_word)
+ * @param   bitmap, bitmap to read
+ * @param   max_bits, size of the bitmap in bits
+ * @param   index, index of the 64-bit word to read
+ * @return  the word, bit n is bit (index * 64 + n) of the bitmap
+ */
+static inline uint64_t get_bitmap_word(uint32_t *bitmap, uint32_t max_bits, uint32_t index)
+{
+  uint64_t word;
+  uint32_t first = index * 64;
+
+  word = bitmap[index * 2];
+
+  if (first + 32 < max_bits) {
+    word |= (uint64_t)bitmap[index * 2 + 1] << 32;
+  } else {
+    word |= 0xFFFFFFFF00000000ULL;
+  }
+
+  if (max_bits - first < 64) {
+    word |= ~0ULL << (max_bits - first);
+  }
+
+  return word;
+}
+
+
+/* @brief   Find the first clear bit in a range of a bitmap
+ *
+ * @param   bitmap, bitmap to search
+ * @param   max_bits, size of the bitmap in bits
+ * @param   start_bit, first bit to search
+ * @param   end_bit, bit to stop searching at, no more than max_bits
+ * @return  index of the clear bit or -1 if all bits in the range are set
+ */
+int find_clear_bit(uint32_t *bitmap, uint32_t max_bits, uint32_t start_bit, uint32_t end_bit)
+{
+  uint64_t word;
+  uint32_t w;
+  uint32_t bit;
+  uint32_t nwords;
+
+  if (start_bit >= end_bit) {
+    return -1;
+  }
+
+  nwords = (max_bits + 63) / 64;
+  w = start_bit / 64;
+
+  // Bits before start_bit in the first word are treated as set
+  word = get_bitmap_word(bitmap, max_bits, w) | ~(~0ULL << (start_bit % 64));
+
+  while (word == ~0ULL) {
+    w++;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    // Skip 128 bits of full bitmap at a time
+    while ((w + 2) * 64 <= max_bits && w * 64 < end_bit
+           && vminvq_u32(vld1q_u32(&bitmap[w * 2])) == 0xFFFFFFFFU) {
+      w += 2;
+    }
+#endif
+
+    if (w >= nwords || w * 64 >= end_bit) {
+      return -1;
+    }
+
+    word = get_bitmap_word(bitmap, max_bits, w);
+  }
+
+  bit = w * 64 + __builtin_ctzll(~word);
+  return (bit < end_bit) ? (int)bit : -1;
+}
+
+
+/* @brief   Count the clear bits starting at a clear bit
+ *
+ * @param   bitmap, bitmap to search
+ * @param   max_bits, size of the bitmap in bits
+ * @param   bit, index of a clear bit
+ * @param   limit, stop counting once this many clear bits are found
+ * @return  number of consecutive clear bits from bit, up to limit
+ */
+uint32_t count_clear_bits(uint32_t *bitmap, uint32_t max_bits, uint32_t bit, uint32_t limit)
 {
-  for (uint32_t w = start_word; w * 32 < max_bits; w++) {
-	  if (bitmap[w] == 0xFFFFFFFFUL) {
-		  continue;
+  uint64_t word;
+  uint32_t count = 0;
+  uint32_t shift;
+  uint32_t n;
+
+  while (count < limit && bit < max_bits) {
+    shift = bit % 64;
+    word = get_bitmap_word(bitmap, max_bits, bit / 64) >> shift;
+
+    if (word == 0) {
+      n = 64 - shift;
+    } else {
+      n = __builtin_ctzll(word);
     }
-   
-    for (uint32_t b = 0; b < 32 && w * 32 + b < max_bits; b++) {
-      if ((bitmap[w] & (1<<b)) == 0) {
-    	  bitmap[w] |= 1<<b;
-    	  return w * 32 + b;
+
+    count += n;
+    bit += n;
+
+    if (n < 64 - shift) {
+      break;
+    }
+  }
+
+  return MIN(count, limit);
+}
+
+
+/* @brief   Find a run of consecutive clear bits in a bitmap
+ *
+ * @param   bitmap, bitmap to search
+ * @param   max_bits, size of the bitmap in bits
+ * @param   start_bit, bit to start searching from
+ * @param   len, number of consecutive clear bits wanted
+ * @return  index of the first bit of the run or -1 if there is none
+ *
+ * The search wraps around to the start of the bitmap, so a run before
+ * start_bit is found only if there is none after it.
+ */
+int find_clear_run(uint32_t *bitmap, uint32_t max_bits, uint32_t start_bit, uint32_t len)
+{
+  uint32_t end_bit = max_bits;
+  uint32_t n;
+  int bit;
+
+  if (start_bit >= max_bits) {
+    start_bit = 0;
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    bit = find_clear_bit(bitmap, max_bits, start_bit, end_bit);
+
+    while (bit != -1) {
+      n = count_clear_bits(bitmap, max_bits, bit, len);
+
+      if (n >= len) {
+        return bit;
       }
+
+      bit = find_clear_bit(bitmap, max_bits, bit + n, end_bit);
     }
+
+    // Then runs starting before start_bit, which may extend past it
+    end_bit = start_bit;
+    start_bit = 0;
   }
-  
+
   return -1;
 }
 
 
+/* @brief   Set a run of bits in a bitmap
+ *
+ * @param   bitmap, bitmap to set bits within
+ * @param   bit, first bit to set
+ * @param   len, number of bits to set
+ */
+void set_bits(uint32_t *bitmap, uint32_t bit, uint32_t len)
+{
+  while (len > 0 && (bit % 32) != 0) {
+    bitmap[bit / 32] |= 1U << (bit % 32);
+    bit++;
+    len--;
+  }
+
+  while (len >= 32) {
+    bitmap[bit / 32] = 0xFFFFFFFFU;
+    bit += 32;
+    len -= 32;
+  }
+
+  while (len > 0) {
+    bitmap[bit / 32] |= 1U << (bit % 32);
+    bit++;
+    len--;
+  }
+}
+
+
+/* @brief   Clear a run of bits in a bitmap
+ *
+ * @param   bitmap, bitmap to clear bits within
+ * @param   bit, first bit to clear
+ * @param   len, number of bits to clear
+ */
+void clear_bits(uint32_t *bitmap, uint32_t bit, uint32_t len)
+{
+  while (len > 0 && (bit % 32) != 0) {
+    bitmap[bit / 32] &= ~(1U << (bit % 32));
+    bit++;
+    len--;
+  }
+
+  while (len >= 32) {
+    bitmap[bit / 32] = 0;
+    bit += 32;
+    len -= 32;
+  }
+
+  while (len > 0) {
+    bitmap[bit / 32] &= ~(1U << (bit % 32));
+    bit++;
+    len--;
+  }
+}
+
+
+/* @brief   Allocate and set a bit in a bitmap
+ *
+ * @param   bitmap, bitmap to allocate and set a bit within
+ * @param   max_bits, maximum size of the bitmap to search
+ * @param   start_word, index of the 32-bit word to start the search from,
+ *          0 to (max_bits - 1) / 32, larger values start from word 0
+ * @return  index of the bit allocated or -1 if every bit is set
+ *
+ * The search starts at the first bit of start_word and wraps around to the
+ * start of the bitmap.
+ */
+int alloc_bit(uint32_t *bitmap, uint32_t max_bits, uint32_t start_word)
+{
+  uint32_t start_bit = start_word * 32;
+  int bit;
+
+  if (start_bit >= max_bits) {
+    start_bit = 0;
+  }
+
+  bit = find_clear_bit(bitmap, max_bits, start_bit, max_bits);
+
+  if (bit == -1) {
+    bit = find_clear_bit(bitmap, max_bits, 0, start_bit);
+  }
+
+  if (bit != -1) {
+    bitmap[bit / 32] |= 1U << (bit % 32);
+  }
+
+  return bit;
+}
+
+
+/* @brief   Allocate and set a run of bits in a bitmap
+ *
+ * @param   bitmap, bitmap to allocate bits within
+ * @param   max_bits, maximum size of the bitmap to search
+ * @param   start_bit, bit in bitmap to start search from
+ * @param   max_len, maximum number of bits to allocate
+ * @param   ret_len, returns the number of bits allocated
+ * @return  index of first bit allocated or -1 if no bits are free from
+ *          start_bit onwards
+ *
+ * The run starts at the first clear bit at or after start_bit and extends
+ * until a set bit is found or max_len bits have been allocated.
+ */
+int alloc_bit_run(uint32_t *bitmap, uint32_t max_bits, uint32_t start_bit,
+                  uint32_t max_len, uint32_t *ret_len)
+{
+  uint32_t len;
+  int bit;
+
+  bit = find_clear_bit(bitmap, max_bits, start_bit, max_bits);
+
+  if (bit == -1) {
+    return -1;
+  }
+
+  len = count_clear_bits(bitmap, max_bits, bit, max_len);
+  set_bits(bitmap, bit, len);
+
+  *ret_len = len;
+  return bit;
+}
+
+
 /* @brief   Clear a bit in a bitmap
  *
  * @param   bitmap, the bitmap to clear a bit within
@@ -53,9 +314,7 @@ int clear_bit(uint32_t *bitmap, int index)
   if (!(bitmap[word] & mask)) {
   	return -1;
   }
-  
+
   bitmap[word] &= ~mask;
   return 0;
 }
-
-
@@ -18,35 +18,52 @@
  * @param   inode, inode of file to allocate block for
  * @param   position, byte offset within the file to allocate block for
  * @return  cached buf of clear new block or NULL on failure with errno set.
- *
- * TODO: Save last allocated block position in inode and use that as a goal.
  */
 struct buf *new_block(struct inode *inode, off_t position)
 {
   struct buf *bp;
   block_t block;
-  int sc;
 
+  if ((block = map_new_block(inode, position)) == NO_BLOCK) {
+    return NULL;
+  }
+
+  if ((bp = get_block(cache, block, BLK_CLEAR)) == NULL) {
+  	panic("extfs: error getting block:%d", block);
+  }
+  
+  return bp;
+}
+
+
+/* @brief   Ensure a position in a file is mapped to a block
+ *
+ * @param   inode, inode of file to allocate block for
+ * @param   position, byte offset within the file to allocate block for
+ * @return  block number, allocated if not already mapped, or NO_BLOCK on failure
+ *
+ * The block is allocated next to the last block allocated to the inode,
+ * see alloc_file_blocks().
+ */
+block_t map_new_block(struct inode *inode, off_t position)
+{
+  block_t block;
+  uint32_t count;
+  int sc;
 	
   if ( (block = read_map_entry(inode, position)) == NO_BLOCK) {
-	  block_t goal = NO_BLOCK;
-
-	  if ((block = alloc_block(inode, goal)) == NO_BLOCK) {
+	  if ((block = alloc_file_blocks(inode, position, 1, &count)) == NO_BLOCK) {
 		  log_warn("extfs: no space\n");
-		  return NULL;
+		  return NO_BLOCK;
 	  }
 	  if ((sc = enter_map_entry(inode, position, block)) != 0) {
 		  free_block(block);
 		  log_warn("extfs: write_map failed, sc:%d", sc);
-		  return NULL;
+		  return NO_BLOCK;
 	  }
   }
 
-  if ((bp = get_block(cache, block, BLK_CLEAR)) == NULL) {
-  	panic("extfs: error getting block:%d, sc:%d", block, sc);
-  }
-  
-  return bp;
+  return block;
 }
 
 
@@ -59,35 +76,133 @@ struct buf *new_block(struct inode *inode, off_t position)
  * block number in which that position is to be found and return it.
  */
 block_t read_map_entry(struct inode *inode, uint64_t position)
+{
+  return read_map_run(inode, position, NULL);
+}
+
+
+/* @brief   Get the block number and length of the run of blocks at a position
+ *
+ * @param   inode, ptr to inode to map from
+ * @param   position, position in file whose blk wanted
+ * @param   ret_len, if not NULL returns the number of blocks, starting at
+ *          position, that are physically contiguous (or are all holes)
+ * @return  block number or NO_BLOCK if the position is within a hole
+ *
+ * The inode's run cache is checked first. On a miss the indirect blocks
+ * are walked and the run found in the final indirect block is added to
+ * the run cache. A missing indirect block is cached as a single hole
+ * covering the whole of the subtree it would have mapped.
+ */
+block_t read_map_run(struct inode *inode, uint64_t position, uint32_t *ret_len)
 {
   struct buf *bp;
   block_t block;
   uint32_t block_pos;
-  static uint32_t offs[8];
+  uint32_t offs[4];
+  uint32_t len = 0;
+  uint32_t span;
+  uint32_t delta;
   int depth;
+  int t;
   
   block_pos = position / sb_block_size;
 
   depth = calc_block_indirection_offsets(position, &offs[0]);
 
   if (depth < 0) {
+    if (ret_len != NULL) {
+      *ret_len = 0;
+    }
     return NO_BLOCK;
+
   } else if (depth == 0) {
+    if (ret_len != NULL) {
+      *ret_len = calc_run_length(inode->odi.i_block, offs[0], EXT2_NDIR_BLOCKS, false);
+    }
     return inode->odi.i_block[offs[0]];   
   } 
+
+  block = lookup_run_cache(inode, block_pos, &len);
+  
+  if (len > 0) {
+    if (ret_len != NULL) {
+      *ret_len = len;
+    }
+    return block;
+  }
   
   block = get_toplevel_indirect_block_entry(inode, depth);
         
-  for (int t=1; t <= depth && block != NO_BLOCK; t++) {
+  for (t = 1; t <= depth && block != NO_BLOCK; t++) {
     bp = get_block(cache, block, BLK_READ);    
     block = read_indirect_block_entry(bp, offs[t]);    
+
+    if (t == depth) {
+      len = calc_run_length((uint32_t *)bp->data, offs[t], sb_addr_in_block, be_cpu);
+    }
+
     put_block(cache, bp);
   }
 
+  if (t <= depth) {
+    // The indirect block at level t is missing, the hole extends to the
+    // end of the range of blocks that it would have mapped.
+    span = 1;
+    delta = 0;
+    
+    for (int k = depth; k >= t; k--) {
+      delta += offs[k] * span;
+      span *= sb_addr_in_block;
+    }
+    
+    len = span - delta;
+  }
+  
+  enter_run_cache(inode, block_pos, block, len);
+
+  if (ret_len != NULL) {
+    *ret_len = len;
+  }
+
   return block;
 }
 
 
+/* @brief   Count the length of a run of entries in a block map
+ *
+ * @param   entries, array of block numbers, either the inode's direct blocks
+ *          or the contents of an indirect block
+ * @param   index, index of the first entry of the run
+ * @param   nentries, number of entries in the array
+ * @param   swap, true if entries need byte-swapping
+ * @return  number of entries from index that map to contiguous physical
+ *          blocks, or that are all NO_BLOCK
+ */
+uint32_t calc_run_length(uint32_t *entries, uint32_t index, uint32_t nentries, bool swap)
+{
+  block_t first;
+  block_t block;
+  uint32_t len;
+  
+  first = bswap4(swap, entries[index]);
+  
+  for (len = 1; index + len < nentries; len++) {
+    block = bswap4(swap, entries[index + len]);
+    
+    if (first == NO_BLOCK) {
+      if (block != NO_BLOCK) {
+        break;
+      }
+    } else if (block != first + len) {
+      break;
+    }
+  }
+  
+  return len;
+}
+
+
 /* Write a new block into the inode's block map
  *
  * @param   inode, inode whose block map to add a block to
@@ -102,7 +217,6 @@ int enter_map_entry(struct inode *inode, off_t position, block_t new_block)
   int depth;
   block_t block;
   struct buf *bp;
-  struct buf *new_bp;
   
   block_pos = position / sb_block_size;
   depth = calc_block_indirection_offsets (position, offs);
@@ -111,6 +225,7 @@ int enter_map_entry(struct inode *inode, off_t position, block_t new_block)
     return -EINVAL;
   }
   
+  invalidate_run_cache(inode, block_pos);
   inode_markdirty(inode);
 
   if (depth == 0) {
@@ -119,40 +234,142 @@ int enter_map_entry(struct inode *inode, off_t position, block_t new_block)
     return 0;    
   }
 
+  if ((block = get_map_leaf(inode, depth, offs)) == NO_BLOCK) {
+    return -ENOSPC;
+  }
+  
+  // enter new_block into final indirection block  
+  bp = get_block(cache, block, BLK_READ);    
+  write_indirect_block_entry(bp, offs[depth], new_block);
+  block_markdirty(bp);
+  put_block(cache, bp);
+  dirty_meta_enter(block, DB_INDIRECT);
+  inode->odi.i_blocks += sb_sectors_in_block;
+  
+  return 0;
+}
+
+
+/* @brief   Write a run of physically contiguous blocks into the inode's block map
+ *
+ * @param   inode, inode whose block map to add the blocks to
+ * @param   position, offset in the file of the first block
+ * @param   new_block, first block number to be inserted
+ * @param   len, number of blocks to insert
+ * @return  0 on success, negative errno on failure
+ *
+ * Each final level indirect block is fetched once for all of the entries
+ * of the run that it holds.
+ */
+int enter_map_run(struct inode *inode, off64_t position, block_t new_block, uint32_t len)
+{
+  uint32_t block_pos;
+  uint32_t offs[4];
+  uint32_t n;
+  int depth;
+  block_t block;
+  struct buf *bp;
+  
+  block_pos = position / sb_block_size;
+  
+  for (uint32_t t = 0; t < len; t++) {
+    invalidate_run_cache(inode, block_pos + t);
+  }
+  
+  inode_markdirty(inode);
+
+  while (len > 0) {
+    depth = calc_block_indirection_offsets((uint64_t)block_pos * sb_block_size, offs);
+
+    if (depth < 0) {
+      return -EINVAL;
+    }
+    
+    if (depth == 0) {
+      inode->odi.i_block[offs[0]] = new_block;
+      inode->odi.i_blocks += sb_sectors_in_block;
+      n = 1;
+    } else {
+      if ((block = get_map_leaf(inode, depth, offs)) == NO_BLOCK) {
+        return -ENOSPC;
+      }
+      
+      n = MIN(len, sb_addr_in_block - offs[depth]);
+      bp = get_block(cache, block, BLK_READ);
+      
+      for (uint32_t t = 0; t < n; t++) {
+        write_indirect_block_entry(bp, offs[depth] + t, new_block + t);
+      }
+      
+      block_markdirty(bp);
+      put_block(cache, bp);
+      dirty_meta_enter(block, DB_INDIRECT);
+      inode->odi.i_blocks += n * sb_sectors_in_block;
+    }
+    
+    block_pos += n;
+    new_block += n;
+    len -= n;
+  }
+  
+  return 0;
+}
+
+
+/* @brief   Get the final level indirect block for a position, allocating
+ *          any missing indirect blocks on the way
+ *
+ * @param   inode, inode whose block map to walk
+ * @param   depth, depth of indirection of the position, at least 1
+ * @param   offs, offsets from calc_block_indirection_offsets()
+ * @return  block number of the final indirect block or NO_BLOCK if out of space
+ */
+block_t get_map_leaf(struct inode *inode, int depth, uint32_t *offs)
+{
+  block_t block;
+  block_t parent;
+  struct buf *bp;
+  struct buf *new_bp;
+
   block = get_toplevel_indirect_block_entry(inode, depth);  
   
   if (block == NO_BLOCK) {
     block = alloc_block(inode, NO_BLOCK);
     
     if (block == NO_BLOCK) {
-      return -ENOSPC;
+      return NO_BLOCK;
     }
 
     bp = get_block(cache, block, BLK_CLEAR);
     block_markdirty(bp);
     put_block(cache, bp);
+    dirty_meta_enter(block, DB_INDIRECT);
 
     set_toplevel_indirect_block_entry(inode, depth, block);
     inode->odi.i_blocks += sb_sectors_in_block;
   }
         
   for (int t=1; t < depth; t++) {
-    bp = get_block(cache, block, BLK_READ);    
+    parent = block;
+    bp = get_block(cache, parent, BLK_READ);    
     block = read_indirect_block_entry(bp, offs[t]);    
 
     if (block == NO_BLOCK) {
       block = alloc_block(inode, NO_BLOCK);
       
       if (block == NO_BLOCK) {
-        return -ENOSPC;
+        put_block(cache, bp);
+        return NO_BLOCK;
       }
       
       new_bp = get_block(cache, block, BLK_CLEAR);
       block_markdirty(new_bp);
       put_block(cache, new_bp);
+      dirty_meta_enter(block, DB_INDIRECT);
       
       write_indirect_block_entry(bp, offs[t], block);
       block_markdirty(bp);
+      dirty_meta_enter(parent, DB_INDIRECT);
 
       inode->odi.i_blocks += sb_sectors_in_block;
     }  
@@ -160,14 +377,7 @@ int enter_map_entry(struct inode *inode, off_t position, block_t new_block)
     put_block(cache, bp);
   }
   
-  // enter new_block into final indirection block  
-  bp = get_block(cache, block, BLK_READ);    
-  write_indirect_block_entry(bp, offs[depth], new_block);
-  block_markdirty(bp);
-  put_block(cache, bp);
-  inode->odi.i_blocks += sb_sectors_in_block;
-  
-  return 0;
+  return block;
 }
 
 
@@ -181,12 +391,8 @@ int enter_map_entry(struct inode *inode, off_t position, block_t new_block)
  * in the block map and the indirect blocks that are now empty
  * due to deleting the entry from the map.
  *
- * TODO: We may want add option to delete mulitple/all blocks
- * to make file deletion or truncation faster.
- *
- * TODO: Need to work out way of optimizing deletes, currently writing
- * NO_BLOCK entry and clearing single bit in bitmap for each block
- * before flushing each time. 
+ * Deleting, truncating or punching a hole in a file frees a whole range
+ * of the block map with delete_map_range() instead.
  */
 int delete_map_entry(struct inode *inode, off_t position)
 {
@@ -206,6 +412,7 @@ int delete_map_entry(struct inode *inode, off_t position)
     return -EINVAL;
   }
   
+  invalidate_run_cache(inode, block_pos);
   inode_markdirty(inode);
 
   if (depth == 0) {
@@ -238,6 +445,7 @@ int delete_map_entry(struct inode *inode, off_t position)
     write_indirect_block_entry(bp, offs[depth], NO_BLOCK);
     block_markdirty(bp);
     put_block(cache, bp);
+    dirty_meta_enter(indirect_blocks[depth], DB_INDIRECT);
     inode->odi.i_blocks -= sb_sectors_in_block;
   }
   
@@ -255,6 +463,7 @@ int delete_map_entry(struct inode *inode, off_t position)
     if (last_empty == true) {
       write_indirect_block_entry(bp, offs[t], NO_BLOCK);
       block_markdirty(bp);
+      dirty_meta_enter(indirect_blocks[t], DB_INDIRECT);
       
       // FIXME: Really need to write bp indirect block before freeing [t+1] block below      
       // otherwise underlying block is freed, we crash, but parent indirect block still
@@ -283,6 +492,139 @@ int delete_map_entry(struct inode *inode, off_t position)
 }
   
 
+/* @brief   Delete the mappings of a range of a file's blocks and free them
+ *
+ * @param   inode, inode of file
+ * @param   first, first logical block of the range
+ * @param   end, logical block after the range
+ * @return  number of blocks freed, including indirect blocks
+ *
+ * The direct blocks and the single, double and triple indirect trees are
+ * walked once. An indirect block lying wholly inside the range is freed
+ * together with everything below it without its entries being rewritten,
+ * and only indirect blocks are read, never the data blocks they map.
+ * Freed blocks are batched so that each group's bitmap and descriptor are
+ * updated once per batch rather than once per block.
+ */
+uint32_t delete_map_range(struct inode *inode, uint64_t first, uint64_t end)
+{
+  struct free_batch fb;
+  uint64_t base;
+  uint64_t span;
+  block_t block;
+
+  init_free_batch(&fb);
+  flush_run_cache(inode);
+
+  for (uint64_t t = first; t < end && t < EXT2_NDIR_BLOCKS; t++) {
+    if (inode->odi.i_block[t] != NO_BLOCK) {
+      free_batch_block(&fb, inode->odi.i_block[t]);
+      inode->odi.i_block[t] = NO_BLOCK;
+    }
+  }
+
+  base = EXT2_NDIR_BLOCKS;
+  span = sb_addr_in_block;
+
+  for (int depth = 1; depth <= 3 && base < end; depth++) {
+    block = get_toplevel_indirect_block_entry(inode, depth);
+
+    if (block != NO_BLOCK && first < base + span) {
+      if (delete_indirect_range(&fb, block, depth, (first > base) ? first - base : 0,
+                                MIN(end - base, span))) {
+        set_toplevel_indirect_block_entry(inode, depth, NO_BLOCK);
+        free_batch_block(&fb, block);
+      }
+    }
+
+    base += span;
+    span *= sb_addr_in_block;
+  }
+
+  flush_free_batch(&fb);
+  inode->odi.i_blocks -= fb.nfreed * sb_sectors_in_block;
+  inode_markdirty(inode);
+  return fb.nfreed;
+}
+
+
+/* @brief   Delete a range of mappings from an indirect tree
+ *
+ * @param   fb, batch to add freed blocks to
+ * @param   block, indirect block at the root of the tree
+ * @param   level, 1 if the block maps data blocks, 2 or 3 if it maps
+ *          further indirect blocks
+ * @param   start, first logical block within the tree to free
+ * @param   end, logical block within the tree after the range
+ * @return  true if the indirect block no longer maps anything, in which
+ *          case the caller frees it and clears its entry in the parent
+ *
+ * If the range covers the whole tree the block's own entries are not
+ * rewritten, as the block itself is about to be freed.
+ */
+bool delete_indirect_range(struct free_batch *fb, block_t block, int level,
+                           uint64_t start, uint64_t end)
+{
+  struct buf *bp;
+  block_t entry;
+  uint64_t span;
+  uint64_t base;
+  bool whole;
+  bool dirty;
+  bool empty;
+
+  if ((bp = get_block(cache, block, BLK_READ)) == NULL) {
+    panic("extfs: Cannot get indirect block");
+  }
+
+  // Number of logical blocks mapped by each entry of this block
+  span = 1;
+
+  for (int t = 1; t < level; t++) {
+    span *= sb_addr_in_block;
+  }
+
+  whole = (start == 0 && end >= span * sb_addr_in_block);
+  dirty = false;
+
+  for (uint32_t t = start / span; t < sb_addr_in_block && (uint64_t)t * span < end; t++) {
+    entry = read_indirect_block_entry(bp, t);
+
+    if (entry == NO_BLOCK) {
+      continue;
+    }
+
+    base = (uint64_t)t * span;
+
+    if (level > 1 && !delete_indirect_range(fb, entry, level - 1, (start > base) ? start - base : 0,
+                                            MIN(end - base, span))) {
+      continue;
+    }
+
+    free_batch_block(fb, entry);
+
+    if (!whole) {
+      write_indirect_block_entry(bp, t, NO_BLOCK);
+      dirty = true;
+    }
+  }
+
+  if (whole) {
+    empty = true;
+  } else {
+    empty = is_empty_indirect_block(bp);
+  }
+
+  if (dirty && !empty) {
+    block_markdirty(bp);
+    dirty_meta_enter(block, DB_INDIRECT);
+  }
+
+  put_block(cache, bp);
+  return empty;
+}
+
+
 /* @brief   Calculate block indirection offsets
  *
  * @param   position, byte position within a file
@@ -290,11 +632,12 @@ int delete_map_entry(struct inode *inode, off_t position)
             double indirect and triple indirect blocks
  * @return  depth of indirect blocks for this file position
  */
-int calc_block_indirection_offsets(uint32_t position, uint32_t *offs)
+int calc_block_indirection_offsets(uint64_t position, uint32_t *offs)
 {
 //  log_info("calc_block_indirection_offsets");
   
-  uint32_t block_pos = position / sb_block_size;
+  // Kept 64-bit so positions past 2^32 blocks fail the range check below
+  uint64_t block_pos = position / sb_block_size;
 	int depth;
 
 //  log_info("after divide");
@@ -338,18 +681,18 @@ int calc_block_indirection_offsets(uint32_t position, uint32_t *offs)
 
 /* @brief   Get the block numbers of indirect blocks
  *
- * @param
- * @param
- * @param
- * @param
- * @return
+ * @param   inode, inode whose block map to walk
+ * @param   depth, depth of indirection for the position offs was computed for
+ * @param   offs, offsets from calc_block_indirection_offsets()
+ * @param   block, returns the indirect block at each level in block[1..depth]
+ * @return  number of levels of indirect blocks present, depth if all exist
  */
 int get_indirect_blocks(struct inode *inode, int depth, uint32_t offs[4], uint32_t block[4])
 {
   int actual;
   struct buf *bp;
   
-  block[9] = 0;   // dummy value to align offs[x] and block[x]
+  block[0] = 0;   // dummy value to align offs[x] and block[x]
   
   for (actual = 0; actual < depth; actual++) {
     if (actual == 0) {
@@ -370,6 +713,112 @@ int get_indirect_blocks(struct inode *inode, int depth, uint32_t offs[4], uint32
 }
 
 
+/* @brief   Find the next data or hole in a file
+ *
+ * @param   inode, inode of file to search
+ * @param   position, offset in the file to start searching from
+ * @param   whence, SEEK_DATA to find data or SEEK_HOLE to find a hole
+ * @return  offset of the data or hole, -ENXIO if position is at or beyond
+ *          the end of file or there is no data after it
+ *
+ * Walks the block map from position. A missing indirect block is skipped
+ * over as a single hole without reading anything beneath it, and each
+ * final level indirect block is scanned once per call. The end of the file
+ * counts as a hole.
+ */
+off64_t seek_data_hole(struct inode *inode, off64_t position, int whence)
+{
+  struct buf *bp;
+  uint32_t blocks[4];
+  uint32_t offs[4];
+  uint32_t block_pos;
+  uint32_t end_pos;
+  uint32_t span;
+  uint32_t delta;
+  uint32_t t;
+  block_t block;
+  bool want_data;
+  int depth;
+  int actual;
+  
+  if (position < 0 || position >= inode->odi.i_size) {
+    return -ENXIO;
+  }
+  
+  want_data = (whence == SEEK_DATA);
+  block_pos = position / sb_block_size;
+  end_pos = (inode->odi.i_size + sb_block_size - 1) / sb_block_size;
+  
+  while (block_pos < end_pos) {
+    depth = calc_block_indirection_offsets((uint64_t)block_pos * sb_block_size, offs);
+    
+    if (depth < 0) {
+      break;
+    }
+    
+    if (depth == 0) {
+      if ((inode->odi.i_block[offs[0]] != NO_BLOCK) == want_data) {
+        goto found;
+      }
+
+      block_pos++;
+      continue;
+    }
+    
+    actual = get_indirect_blocks(inode, depth, offs, blocks);
+    
+    if (actual < depth) {
+      if (want_data == false) {
+        goto found;
+      }
+
+      // Indirect block at level actual+1 is missing, skip everything it maps
+      span = 1;
+      delta = 0;
+      
+      for (int k = depth; k > actual; k--) {
+        delta += offs[k] * span;
+        span *= sb_addr_in_block;
+      }
+      
+      block_pos += span - delta;
+      continue;
+    }
+    
+    bp = get_block(cache, blocks[depth], BLK_READ);
+    
+    if (bp == NULL) {
+      panic("extfs: Cannot get indirect block");
+    }
+    
+    for (t = offs[depth]; t < sb_addr_in_block && block_pos < end_pos; t++) {
+      block = read_indirect_block_entry(bp, t);
+      
+      if ((block != NO_BLOCK) == want_data) {
+        break;
+      }
+      
+      block_pos++;
+    }
+    
+    put_block(cache, bp);
+    
+    if (t < sb_addr_in_block && block_pos < end_pos) {
+      goto found;
+    }
+  }
+  
+  if (want_data) {
+    return -ENXIO;
+  }
+  
+  return inode->odi.i_size;
+
+found:
+  return MAX(position, (off64_t)block_pos * sb_block_size);
+}
+
+
 /* @brief
  *
  * @param
@@ -482,90 +931,226 @@ void zero_block(struct buf *bp)
  * @return  block number of allocated block or NO_BLOCK on error
  */
 block_t alloc_block(struct inode *inode, block_t goal)
+{
+  uint32_t count;
+
+  return alloc_blocks(inode, goal, 1, &count);
+}
+
+
+/* @brief   Allocate a run of contiguous blocks
+ *
+ * @param   inode, inode the blocks are being allocated for
+ * @param   goal, block to start searching from or NO_BLOCK
+ * @param   count, maximum number of blocks to allocate
+ * @param   ret_count, returns the number of blocks allocated
+ * @return  first block of the run or NO_BLOCK if there is no free space
+ *
+ * The first free run at or after the goal that is long enough for the
+ * request, up to ALLOC_RUN_SEARCH_LEN blocks, is used. Groups are searched
+ * from the goal's group onwards, wrapping around, and groups whose free
+ * space summary shows no such run are skipped without reading their
+ * bitmaps. If no group has one, the run starts at the first free block at
+ * or after the goal, searching the goal's group again from its start last. The run may be shorter than
+ * count if it reaches an allocated block or the end of a group, in which
+ * case the caller should allocate the remainder with another call. The
+ * group's bitmap is updated once for the whole run.
+ */
+block_t alloc_blocks(struct inode *inode, block_t goal, uint32_t count, uint32_t *ret_count)
+{
+  return alloc_reserve_blocks(inode, goal, count, 0, ret_count, NULL);
+}
+
+
+/* @brief   Allocate a run of contiguous blocks and reserve the blocks after it
+ *
+ * @param   inode, inode the blocks are being allocated for
+ * @param   goal, block to start searching from or NO_BLOCK
+ * @param   count, maximum number of blocks to allocate
+ * @param   reserve, number of free blocks wanted after the run
+ * @param   ret_count, returns the number of blocks allocated
+ * @param   ret_reserved, returns the number of free blocks that follow the
+ *          run, up to reserve, or NULL if reserve is 0
+ * @return  first block of the run or NO_BLOCK if there is no free space
+ *
+ * As alloc_blocks(), but the search is for a run of count + reserve blocks.
+ * Only count of them are allocated in the bitmap, the rest are left free
+ * for the caller to hold as an in-memory preallocation window. Blocks in
+ * other inodes' windows are never allocated or reserved.
+ */
+block_t alloc_reserve_blocks(struct inode *inode, block_t goal, uint32_t count, uint32_t reserve,
+                             uint32_t *ret_count, uint32_t *ret_reserved)
 {
   struct buf *bp;
   struct group_desc *gd;
-  block_t block = NO_BLOCK;
-  uint32_t bit = NO_BLOCK;
+  block_t block;
   uint32_t *bitmap;
+  uint32_t len;
+  uint32_t want;
+  uint32_t start_bit;
+  uint32_t goal_bit;
+  int goal_group;
   int group;
-  int word;                 /* word in block bitmap to start searching from */
+  int bit;
+
+  *ret_count = 0;
 
-  if (superblock.s_free_blocks_count == 0) {
+  if (ret_reserved != NULL) {
+    *ret_reserved = 0;
+  }
+  
+  // Blocks reserved for delayed allocation are not available
+  if (superblock.s_free_blocks_count <= nr_delalloc_reserved || count == 0) {
   	return NO_BLOCK;
   }
 
+  count = MIN(count, superblock.s_free_blocks_count - nr_delalloc_reserved);
+
   if (goal == NO_BLOCK) {
 	  group = (inode->i_ino - 1) / superblock.s_inodes_per_group;
 	  goal = superblock.s_blocks_per_group * group + superblock.s_first_data_block;
   }
 
-  if (goal >= superblock.s_blocks_count || (goal < superblock.s_first_data_block && goal != NO_BLOCK)) {
-  	goal = rand() % superblock.s_blocks_count;
+  if (goal >= superblock.s_blocks_count || goal < superblock.s_first_data_block) {
+  	goal = superblock.s_first_data_block;
   }
 
-  /* Allocate a block starting from the goal's group and from the goal's bitmap "word".
-   * We wrap around to the first group and continue searching.  We finally search the
-   * goal's group again, but this time from beginning of goal group's bitmap.
-   */
-  group = (goal - superblock.s_first_data_block) / superblock.s_blocks_per_group;
-  word = ((goal - superblock.s_first_data_block) % superblock.s_blocks_per_group) / 32;
+  goal_group = (goal - superblock.s_first_data_block) / superblock.s_blocks_per_group;
+  goal_bit = (goal - superblock.s_first_data_block) % superblock.s_blocks_per_group;
+  want = MIN(count + reserve, ALLOC_RUN_SEARCH_LEN);
 
-  for (int i = 0; i <= sb_groups_count; i++) {
-	  group = i % sb_groups_count;
+  // The first pass looks for a free run of want blocks, passing over
+  // groups whose summary shows they have none. The second pass takes
+  // whatever is free at or after the goal.
+  for (int pass = 0; pass < 2; pass++) {
+    start_bit = goal_bit;
     
-	  gd = get_group_desc(group);
+    for (int i = 0; i <= sb_groups_count; i++) {
+  	  group = (goal_group + i) % sb_groups_count;
+      
+  	  if ((gd = get_group_desc(group)) == NULL) {
+  		  panic("extfs: can't get group_desc to alloc block");
+      }
+      
+  	  if (gd->g_free_blocks_count == 0
+  	      || (pass == 0 && (i == sb_groups_count || gd->g_free_blocks_count < want
+  	                        || !group_may_have_run(group, want)))) {
+  		  start_bit = 0;
+  		  continue;
+  	  }
+
+  	  if ((bp = get_block(cache, gd->g_block_bitmap, BLK_READ)) == NULL) {
+        panic("extfs: failed to get bitmap block for alloc block");
+      }
+      
+      bitmap = (uint32_t *)bp->data;
+      
+      if (group_summaries[group].state != GS_EXACT) {
+        build_group_summary(group, bitmap);
+      }
 
-	  if (gd == NULL) {
-		  panic("extfs: can't get group_desc to alloc block");
-    }
-    
-	  if (gd->g_free_blocks_count == 0) {
-		  word = 0;
-		  continue;
-	  }
+      // Other files' preallocation windows look allocated while searching
+      mask_prealloc(group, bitmap, true);
+      
+      if (pass == 0) {
+        bit = find_clear_run(bitmap, superblock.s_blocks_per_group, start_bit, want);
+
+        if (bit == -1) {
+          mask_prealloc(group, bitmap, false);
+          put_block(cache, bp);
+          start_bit = 0;
+          continue;
+        }
+        
+        start_bit = bit;
+      }
+      
+      len = MIN(count, gd->g_free_blocks_count);
+      bit = alloc_bit_run(bitmap, superblock.s_blocks_per_group, start_bit, len, &len);
 
-	  bp = get_block(cache, gd->g_block_bitmap, BLK_READ);
-    
-    if (bp == NULL) {
-      panic("extfs: failed to get bitmap block for alloc block");
-    }
-    
-    bitmap = (uint32_t *)bp->data;
-    
-    bit = alloc_bit(bitmap, superblock.s_blocks_per_group, 0); // FIXME: Search from word in initial look?
+      if (bit != -1 && ret_reserved != NULL && len == count) {
+        *ret_reserved = count_clear_bits(bitmap, superblock.s_blocks_per_group, bit + len, reserve);
+      }
 
-    if (bit != -1) {    
-	    block = superblock.s_first_data_block + (group * superblock.s_blocks_per_group) + bit;
-	    check_block_number(gd, block);
+      mask_prealloc(group, bitmap, false);
+      
+      if (bit != -1) {
+  	    block = superblock.s_first_data_block + (group * superblock.s_blocks_per_group) + bit;
+  	    check_block_range(gd, block, len);
 
-	    block_markdirty(bp);
-	    put_block(cache, bp);
+        build_group_summary(group, bitmap);
+  	    block_markdirty(bp);
+  	    put_block(cache, bp);
+        dirty_meta_enter(gd->g_block_bitmap, DB_BITMAP);
 
-	    gd->g_free_blocks_count--;
-	    superblock.s_free_blocks_count--;
+  	    gd->g_free_blocks_count -= len;
+  	    superblock.s_free_blocks_count -= len;
 
-      group_descriptors_markdirty();
-      return block;
-    } 
-    
-    /* For first block we search from goal word in bitmap, so there may be free
-     * bits before the 'goal' bit.  For all other blocks and also next time we
-     * check the 'goal' block we start from the beginning of the bitmap. If we
-     * fail to allocate a bit but g_free_blocks_count says the group has free
-     * bits then we panic.
-     */
-    if (i != 0) {
-		  panic("extfs: allocator failed to allocate a bit in bitmap with free bits");
-	  }
-		
-		word = 0;
+        group_descriptors_markdirty(group);
+        *ret_count = len;
+        return block;
+      }
+      
+      put_block(cache, bp);
+      start_bit = 0;
+    }
   }
   
   return NO_BLOCK;
 }
 
 
+/* @brief   Allocate a run of blocks known to be free
+ *
+ * @param   block, first block of the run, from a preallocation window
+ * @param   count, number of blocks in the run, all within one group
+ * @return  number of blocks allocated, which is less than count only if
+ *          a block in the run was not free
+ */
+uint32_t claim_blocks(block_t block, uint32_t count)
+{
+  struct buf *bp;
+  struct group_desc *gd;
+  uint32_t *bitmap;
+  uint32_t bit;
+  int group;
+
+  group = (block - superblock.s_first_data_block) / superblock.s_blocks_per_group;
+  bit = (block - superblock.s_first_data_block) % superblock.s_blocks_per_group;
+  
+  if ((gd = get_group_desc(group)) == NULL) {
+	  panic("extfs: can't get group_desc to claim blocks");
+  }
+
+  if ((bp = get_block(cache, gd->g_block_bitmap, BLK_READ)) == NULL) {
+    panic("extfs: failed to get bitmap block for claim blocks");
+  }
+
+  bitmap = (uint32_t *)bp->data;
+  count = MIN(count, gd->g_free_blocks_count);
+  count = count_clear_bits(bitmap, superblock.s_blocks_per_group, bit, count);
+
+  if (count == 0) {
+    put_block(cache, bp);
+    return 0;
+  }
+  
+  check_block_range(gd, block, count);
+  set_bits(bitmap, bit, count);
+
+  build_group_summary(group, bitmap);
+  block_markdirty(bp);
+  put_block(cache, bp);
+  dirty_meta_enter(gd->g_block_bitmap, DB_BITMAP);
+
+  gd->g_free_blocks_count -= count;
+  superblock.s_free_blocks_count -= count;
+
+  group_descriptors_markdirty(group);
+  return count;
+}
+
+
 /* @brief   Free a block
  * 
  * @param   block, the block to free
@@ -599,12 +1184,109 @@ void free_block(block_t block)
   
   block_markdirty(bp);
   put_block(cache, bp);
+  dirty_meta_enter(gd->g_block_bitmap, DB_BITMAP);
+  group_summary_freed(group);
 
   gd->g_free_blocks_count++;
   superblock.s_free_blocks_count++;
 
-  group_descriptors_markdirty();  
+  group_descriptors_markdirty(group);
   invalidate_block(cache, block);
+  dirty_block_remove(block);
+}
+
+
+/* @brief   Start an empty batch of blocks to free
+ *
+ * @param   fb, batch to initialize
+ */
+void init_free_batch(struct free_batch *fb)
+{
+  fb->group = -1;
+  fb->count = 0;
+  fb->nfreed = 0;
+}
+
+
+/* @brief   Add a block to a batch of blocks to free
+ *
+ * @param   fb, batch of blocks to free
+ * @param   block, the block to free
+ *
+ * The batch is flushed when it is full or when the block belongs to a
+ * different group to the blocks already in it. Blocks of a file are
+ * mostly in one or a few groups, so a truncate touches each group's bitmap
+ * and descriptor a handful of times instead of once per block.
+ */
+void free_batch_block(struct free_batch *fb, block_t block)
+{
+  int group;
+
+  if (block >= superblock.s_blocks_count || block < superblock.s_first_data_block) {
+	  panic("extfs: trying to free block %d beyond blocks scope.", block);
+  }
+
+  group = (block - superblock.s_first_data_block) / superblock.s_blocks_per_group;
+
+  if (fb->count == FREE_BATCH_SZ || (fb->count > 0 && group != fb->group)) {
+    flush_free_batch(fb);
+  }
+
+  fb->group = group;
+  fb->blocks[fb->count++] = block;
+  fb->nfreed++;
+}
+
+
+/* @brief   Free the blocks in a batch
+ *
+ * @param   fb, batch of blocks, all in the same group
+ *
+ * The group's bitmap is read once and its free counts updated once for
+ * the whole batch.
+ */
+void flush_free_batch(struct free_batch *fb)
+{
+  int bit;
+  struct buf *bp;
+  struct group_desc *gd;
+  uint32_t *bitmap;
+  block_t block;
+
+  if (fb->count == 0) {
+    return;
+  }
+
+  if ((gd = get_group_desc(fb->group)) == NULL) {
+  	panic("extfs: can't get group_desc to free blocks");
+  }
+
+  bp = get_block(cache, gd->g_block_bitmap, BLK_READ);
+  bitmap = (uint32_t *)bp->data;
+
+  for (uint32_t t = 0; t < fb->count; t++) {
+    block = fb->blocks[t];
+    check_block_number(gd, block);
+    bit = (block - superblock.s_first_data_block) % superblock.s_blocks_per_group;
+
+    if (clear_bit(bitmap, bit)) {
+  	  panic("extfs: failed freeing unused block %d", block);
+    }
+
+    invalidate_block(cache, block);
+    dirty_block_remove(block);
+  }
+
+  block_markdirty(bp);
+  put_block(cache, bp);
+  dirty_meta_enter(gd->g_block_bitmap, DB_BITMAP);
+  group_summary_freed(fb->group);
+
+  gd->g_free_blocks_count += fb->count;
+  superblock.s_free_blocks_count += fb->count;
+
+  group_descriptors_markdirty(fb->group);
+  fb->count = 0;
 }
 
 
@@ -632,3 +1314,35 @@ void check_block_number(struct group_desc *gd, block_t block)
 }
 
 
+/* @brief   Sanity checking to ensure an allocated run holds no system block
+ *
+ * @param   gd, group descriptor that the run should belong to
+ * @param   block, first block of the run
+ * @param   len, number of blocks in the run
+ *
+ * The whole run is compared against the group's bitmaps and inode table,
+ * not just its ends, as a run may span them.
+ */
+void check_block_range(struct group_desc *gd, block_t block, uint32_t len)
+{
+  block_t end = block + len;
+  block_t itable_end = gd->g_inode_table + sb_inode_table_blocks_per_group;
+
+  if ((gd->g_block_bitmap >= block && gd->g_block_bitmap < end)
+      || (gd->g_inode_bitmap >= block && gd->g_inode_bitmap < end)
+      || (block < itable_end && gd->g_inode_table < end)) {
+    log_error("check_block_range block:%u, len:%u", (uint32_t)block, len);
+    log_error("gd->g_inode_bitmap:%u", (uint32_t)gd->g_inode_bitmap);
+    log_error("gd->g_block_bitmap:%u", (uint32_t)gd->g_block_bitmap);
+    log_error("gd->g_inode_table:%u", (uint32_t)gd->g_inode_table);
+    log_error("sb_inode_table_blocks_per_group:%u", (uint32_t)sb_inode_table_blocks_per_group);
+    
+	  panic("extfs: block allocator tried to return a run containing a system block");
+  }
+
+  if (end > superblock.s_blocks_count) {
+	  panic("extfs: block allocator returned a run beyond the total number of blocks");
+  }
+}
+
+
@@ -0,0 +1,102 @@
+/* This file commits metadata at the end of each batch of messages.
+ *
+ * The main loop handles every message waiting on the port before it waits
+ * again, and the end of each such batch is a commit point. Normally the
+ * only work done there is writing the superblock if an unlink has added
+ * to the orphan list during the batch. The rest of the metadata is left
+ * to the periodic flusher.
+ *
+ * With the sync metadata option, replies to operations that change
+ * metadata are held back until the end of the batch. Dirty inodes are
+ * then copied into the inode table and the dirty metadata blocks are
+ * written, bitmaps first, then indirect, inode-table and directory blocks,
+ * followed by the group descriptors and the superblock. Only then are the
+ * held replies sent. Operations in one batch that change the same bitmap,
+ * inode-table or directory block share a single write of it. Metadata
+ * blocks pushed out of a full dirty block table during the batch are kept
+ * on a pending list and written with the rest. Once the list is half full
+ * the batch is committed early, before the next reply is held back.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Reply to a message once the metadata it changed is on disk
+ *
+ * @param   port, msgport to reply on
+ * @param   id, message id to reply to
+ * @param   status, result of the operation
+ * @param   buf, reply data or NULL, no larger than an ioreply_t
+ * @param   sz, size of reply data
+ * @return  0 if the reply is held back, otherwise the result of replymsg()
+ *
+ * Without the sync metadata option, or if the operation failed, the reply
+ * is sent straight away.
+ */
+int commit_replymsg(int port, msgid_t id, int status, void *buf, size_t sz)
+{
+  struct commit_reply *cr;
+
+  if (config.sync_metadata == false || status < 0) {
+    return replymsg(port, id, status, buf, sz);
+  }
+
+  assert(sz <= sizeof (ioreply_t));
+
+  if (nr_commit_replies == NR_COMMIT_REPLIES || nr_commit_pending >= NR_COMMIT_PENDING / 2) {
+    commit_batch();
+  }
+
+  cr = &commit_replies[nr_commit_replies++];
+  cr->port = port;
+  cr->msgid = id;
+  cr->status = status;
+  cr->sz = sz;
+
+  if (sz > 0) {
+    memcpy(&cr->reply, buf, sz);
+  }
+
+  return 0;
+}
+
+
+/* @brief   Commit the metadata changed by a batch of messages
+ *
+ * Called by the main loop after it has handled all waiting messages.
+ */
+void commit_batch(void)
+{
+  struct commit_reply *cr;
+
+  if (config.read_only == false) {
+    if (nr_commit_replies > 0 || nr_commit_pending > 0) {
+      flush_dirty_inodes();
+
+      for (int type = DB_BITMAP; type <= DB_DIRECTORY; type++) {
+        writeback_metadata(type);
+        writeback_commit_pending(type);
+      }
+
+      write_group_descriptors();
+      write_superblock();
+    } else if (sb_superblock_dirty) {
+      write_superblock();
+    }
+  }
+
+  for (int t = 0; t < nr_commit_replies; t++) {
+    cr = &commit_replies[t];
+    replymsg(cr->port, cr->msgid, cr->status, (cr->sz > 0) ? &cr->reply : NULL, cr->sz);
+  }
+
+  nr_commit_replies = 0;
+  nr_commit_pending = 0;
+}
+
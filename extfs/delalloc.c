@@ -0,0 +1,376 @@
+/* This file handles delayed allocation of file blocks.
+ *
+ * Data written to a hole in a regular file is not given a physical block
+ * straight away. It is kept in a buffer from a small pool, keyed by inode
+ * and logical block, and counted against the free block count so that a
+ * later allocation cannot fail for lack of space. Physical blocks are
+ * allocated when the file is closed, when its inode leaves the inode
+ * cache, when the pool is full or when the periodic flusher finds a
+ * buffer older than the dirty expire time. By then the whole of the range written
+ * is known and it is allocated as contiguous runs. A file that is deleted
+ * before then never has blocks allocated for it at all.
+ *
+ * While space is low, writes bypass the pool and allocate immediately,
+ * so the few indirect blocks a flush may need can always be found.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include <sys/mman.h>
+#include <time.h>
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Initialize the delayed allocation buffer pool
+ *
+ * Called once the block size is known.
+ */
+void init_delalloc(void)
+{
+  struct delalloc_block *db;
+
+  LIST_INIT(&free_delalloc_list);
+  LIST_INIT(&delalloc_lru_list);
+
+  for (int t = 0; t < DELALLOC_HASH_SIZE; t++) {
+    LIST_INIT(&delalloc_hash[t]);
+  }
+
+  nr_delalloc_reserved = 0;
+
+  if (config.delalloc == false) {
+    return;
+  }
+
+  delalloc_buf = mmap(NULL, NR_DELALLOC_BLOCKS * sb_block_size, PROT_READ | PROT_WRITE, 0, -1, 0);
+
+  if (delalloc_buf == NULL) {
+    panic("ext2fs can't allocate delayed allocation buffers");
+  }
+
+  for (int t = 0; t < NR_DELALLOC_BLOCKS; t++) {
+    db = &delalloc_table[t];
+    db->ino = NO_INODE;
+    db->data = delalloc_buf + t * sb_block_size;
+    LIST_ADD_TAIL(&free_delalloc_list, db, lru_link);
+  }
+}
+
+
+/* @brief   Reset the delayed allocation state of an inode
+ *
+ * @param   inode, inode that has been loaded into the inode cache
+ */
+void init_inode_delalloc(struct inode *inode)
+{
+  LIST_INIT(&inode->i_delalloc_list);
+  inode->i_delalloc_count = 0;
+}
+
+
+/* @brief   Find the delayed allocation buffer of a block of a file
+ *
+ * @param   inode, inode of file
+ * @param   block_pos, logical block within the file
+ * @return  buffer holding the block's data or NULL if there is none
+ */
+struct delalloc_block *delalloc_lookup(struct inode *inode, uint32_t block_pos)
+{
+  struct delalloc_block *db;
+  int h;
+
+  if (inode->i_delalloc_count == 0) {
+    return NULL;
+  }
+
+  h = (inode->i_ino + block_pos) % DELALLOC_HASH_SIZE;
+  db = LIST_HEAD(&delalloc_hash[h]);
+
+  while (db != NULL) {
+    if (db->ino == inode->i_ino && db->block_pos == block_pos) {
+      return db;
+    }
+
+    db = LIST_NEXT(db, hash_link);
+  }
+
+  return NULL;
+}
+
+
+/* @brief   Write part of a block of a file without allocating it
+ *
+ * @param   inode, inode of file being written
+ * @param   position, position within file to write
+ * @param   off, offset within the current block
+ * @param   chunk_size, number of bytes to write
+ * @param   msg_off, offset in message buffer
+ * @param   src, data already read from the message or NULL to read it
+ * @return  0 on success, 1 if the block must be allocated now instead,
+ *          negative errno on failure
+ *
+ * Only called for positions not mapped to a block. A new buffer starts
+ * out zeroed, as a hole would read.
+ */
+int write_delalloc(struct inode *inode, off64_t position, size_t off, size_t chunk_size,
+                   size_t msg_off, const uint8_t *src)
+{
+  struct delalloc_block *db;
+  uint32_t block_pos;
+  int sc;
+
+  if (config.delalloc == false || !S_ISREG(inode->odi.i_mode)) {
+    return 1;
+  }
+
+  block_pos = position / sb_block_size;
+
+  if ((db = delalloc_lookup(inode, block_pos)) == NULL) {
+    if (superblock.s_free_blocks_count < nr_delalloc_reserved + DELALLOC_LOW_SPACE) {
+      return 1;
+    }
+
+    if (LIST_EMPTY(&free_delalloc_list)) {
+      if (flush_delalloc(find_inode(LIST_HEAD(&delalloc_lru_list)->ino)) != 0
+          || LIST_EMPTY(&free_delalloc_list)) {
+        return 1;
+      }
+    }
+
+    db = delalloc_enter(inode, block_pos);
+    memset(db->data, 0, sb_block_size);
+  }
+
+  if (src != NULL) {
+    memcpy(db->data + off, src, chunk_size);
+    return 0;
+  }
+  
+  sc = readmsg(portid, msgid, db->data + off, chunk_size, msg_off);
+
+  if (sc != chunk_size) {
+    log_info("write_delalloc readmsg returned:%d", sc);
+    return -EIO;
+  }
+
+  return 0;
+}
+
+
+/* @brief   Take a buffer from the pool for a block of a file
+ *
+ * @param   inode, inode of file being written
+ * @param   block_pos, logical block within the file
+ * @return  buffer, which the pool must have free
+ */
+struct delalloc_block *delalloc_enter(struct inode *inode, uint32_t block_pos)
+{
+  struct delalloc_block *db;
+  int h;
+
+  db = LIST_HEAD(&free_delalloc_list);
+  LIST_REM_HEAD(&free_delalloc_list, lru_link);
+
+  db->ino = inode->i_ino;
+  db->block_pos = block_pos;
+  db->dirtied = time(NULL);
+
+  h = (inode->i_ino + block_pos) % DELALLOC_HASH_SIZE;
+  LIST_ADD_HEAD(&delalloc_hash[h], db, hash_link);
+  LIST_ADD_TAIL(&delalloc_lru_list, db, lru_link);
+
+  LIST_ADD_TAIL(&inode->i_delalloc_list, db, inode_link);
+  inode->i_delalloc_count++;
+  nr_delalloc_reserved++;
+  return db;
+}
+
+
+/* @brief   Return a buffer to the pool
+ *
+ * @param   inode, inode of file the buffer belongs to
+ * @param   db, buffer to free
+ */
+void delalloc_remove(struct inode *inode, struct delalloc_block *db)
+{
+  int h;
+
+  h = (db->ino + db->block_pos) % DELALLOC_HASH_SIZE;
+  LIST_REM_ENTRY(&delalloc_hash[h], db, hash_link);
+  LIST_REM_ENTRY(&delalloc_lru_list, db, lru_link);
+  LIST_REM_ENTRY(&inode->i_delalloc_list, db, inode_link);
+
+  db->ino = NO_INODE;
+  LIST_ADD_HEAD(&free_delalloc_list, db, lru_link);
+
+  inode->i_delalloc_count--;
+  nr_delalloc_reserved--;
+}
+
+
+/* @brief   Allocate blocks for, and write out, a file's delayed blocks
+ *
+ * @param   inode, inode of file to flush
+ * @return  0 on success, negative errno if blocks could not be allocated
+ *
+ * Each run of consecutive logical blocks is allocated with as few calls
+ * to alloc_file_blocks() as possible. The data is copied into the block
+ * cache and the blocks are marked dirty.
+ */
+int flush_delalloc(struct inode *inode)
+{
+  struct delalloc_block *db;
+  struct delalloc_block *next;
+  struct dirty_block *dirty;
+  struct buf *bp;
+  uint32_t block_pos;
+  uint32_t len;
+  uint32_t count;
+  block_t block;
+  int sc;
+
+  if (inode == NULL) {
+    log_error("flush_delalloc: inode of delayed blocks not cached");
+    return -EINVAL;
+  }
+
+  while ((db = LIST_HEAD(&inode->i_delalloc_list)) != NULL) {
+    // Find the lowest delayed block and the run of blocks that follow it
+    for (next = db; next != NULL; next = LIST_NEXT(next, inode_link)) {
+      if (next->block_pos < db->block_pos) {
+        db = next;
+      }
+    }
+
+    block_pos = db->block_pos;
+
+    for (len = 1; delalloc_lookup(inode, block_pos + len) != NULL; len++) {
+    }
+
+    // Release the run's reservation so alloc_blocks() will hand it out
+    nr_delalloc_reserved -= len;
+    block = alloc_file_blocks(inode, (off64_t)block_pos * sb_block_size, len, &count);
+    nr_delalloc_reserved += len;
+
+    if (block == NO_BLOCK) {
+      log_error("flush_delalloc: no space for ino:%u", (uint32_t)inode->i_ino);
+      return -ENOSPC;
+    }
+
+    if ((sc = enter_map_run(inode, (off64_t)block_pos * sb_block_size, block, count)) != 0) {
+      log_error("flush_delalloc: enter_map_run failed, sc:%d", sc);
+
+      for (uint32_t t = 0; t < count; t++) {
+        if (read_map_entry(inode, (off64_t)(block_pos + t) * sb_block_size) != block + t) {
+          free_block(block + t);
+        }
+      }
+      return sc;
+    }
+
+    for (uint32_t t = 0; t < count; t++) {
+      db = delalloc_lookup(inode, block_pos + t);
+
+      if ((bp = get_block(cache, block + t, BLK_CLEAR)) == NULL) {
+        panic("extfs: error getting block:%u", (uint32_t)(block + t));
+      }
+
+      memcpy(bp->data, db->data, sb_block_size);
+      block_markdirty(bp);
+      put_block(cache, bp);
+      dirty_block_enter(block + t);
+
+      // Keep the age of the data so the flusher's expire time still applies
+      dirty = dirty_block_lookup(block + t);
+
+      if (dirty->dirtied > db->dirtied) {
+        dirty->dirtied = db->dirtied;
+      }
+
+      delalloc_remove(inode, db);
+    }
+  }
+
+  return 0;
+}
+
+
+/* @brief   Flush the delayed blocks of files written longest ago
+ *
+ * @param   now, current time
+ *
+ * Called by the periodic flusher so that data in a file that stays open
+ * reaches the disk within the dirty expire time. Every delayed block of a
+ * file whose oldest buffer has expired is flushed.
+ */
+void flush_expired_delalloc(time_t now)
+{
+  struct delalloc_block *db;
+
+  // The list runs from least to most recently taken from the pool
+  while ((db = LIST_HEAD(&delalloc_lru_list)) != NULL
+         && now - db->dirtied >= config.dirty_expire_secs) {
+    if (flush_delalloc(find_inode(db->ino)) != 0) {
+      log_warn("extfs: can't flush expired delayed blocks of ino:%u", (uint32_t)db->ino);
+      break;
+    }
+  }
+}
+
+
+/* @brief   Discard a file's delayed blocks within a range of logical blocks
+ *
+ * @param   inode, inode of file being deleted, truncated or punched
+ * @param   block_pos, first logical block to discard
+ * @param   end_pos, logical block after the range
+ */
+void discard_delalloc(struct inode *inode, uint32_t block_pos, uint32_t end_pos)
+{
+  struct delalloc_block *db;
+  struct delalloc_block *next;
+
+  db = LIST_HEAD(&inode->i_delalloc_list);
+
+  while (db != NULL) {
+    next = LIST_NEXT(db, inode_link);
+
+    if (db->block_pos >= block_pos && db->block_pos < end_pos) {
+      delalloc_remove(inode, db);
+    }
+
+    db = next;
+  }
+}
+
+
+/* @brief   Flush the delayed blocks of every file
+ *
+ * Called before the filesystem handler exits. The delayed blocks of a
+ * file that cannot be flushed are discarded, and their data lost, so
+ * that the others can still be written.
+ */
+void flush_all_delalloc(void)
+{
+  struct delalloc_block *db;
+  struct inode *inode;
+  
+  while ((db = LIST_HEAD(&delalloc_lru_list)) != NULL) {
+    // Inodes with delayed blocks are never evicted, so this finds it cached
+    if ((inode = get_inode(db->ino)) == NULL) {
+      log_error("flush_all_delalloc: can't get ino:%u, delayed blocks lost", (uint32_t)db->ino);
+      break;
+    }
+    
+    if (flush_delalloc(inode) != 0) {
+      log_error("flush_all_delalloc: ino:%u, delayed blocks lost", (uint32_t)inode->i_ino);
+      discard_delalloc(inode, 0, UINT32_MAX);
+    }
+
+    put_inode(inode);
+  }
+}
+
@@ -44,6 +44,7 @@ int dirent_delete(struct inode *dir_inode, char *name)
 
     if (r == 0) {   // file dirent has been deleted
       put_block(cache, bp);
+      dirty_meta_enter(read_map_entry(dir_inode, pos), DB_DIRECTORY);
       return 0;
     }
 
@@ -120,7 +121,7 @@ void delete_dir_entry(struct inode *dir_inode, struct dir_entry *dp,
 	  prev_dp->d_rec_len = bswap2(be_cpu, temp);
   }
   
-  write_inode(dir_inode);
+  inode_markdirty(dir_inode);
 }
 
 
@@ -50,7 +50,13 @@ int dirent_enter(struct inode *dir_inode, char *name, ino_t ino_nr, mode_t mode)
     r = find_dirent_free_space(dir_inode, bp, required_space, &dp);
 
 	  if (r == 0) {
-      return enter_dirent(dir_inode, bp, dp, ino_nr, name, name_len, mode);
+      r = enter_dirent(dir_inode, bp, dp, ino_nr, name, name_len, mode);
+
+      if (r == 0) {
+        dirty_meta_enter(read_map_entry(dir_inode, pos), DB_DIRECTORY);
+      }
+
+      return r;
 	  }
 
 	  put_block(cache, bp);
@@ -146,7 +152,6 @@ int enter_dirent(struct inode *dir_inode, struct buf *bp, struct dir_entry *dp,
 
   dir_inode->i_update |= CTIME | MTIME;
   inode_markdirty(dir_inode);
-  write_inode(dir_inode);
 
   return 0;
 }
@@ -0,0 +1,326 @@
+/* This file tracks file data blocks that may be dirty in the block cache.
+ *
+ * Reads that bypass the block cache and go directly to the block device
+ * must not return stale data for a block that has been written through
+ * the cache but not yet written back to disk. Every file data block that
+ * is marked dirty in the block cache is entered into this table. A block
+ * remains in the table until it is freed or written back by us, so the
+ * table may contain blocks the cache has already evicted, but it never
+ * misses a block that is still dirty.
+ *
+ * Bitmaps, indirect, inode-table and directory blocks are entered too, with
+ * their type, so that the periodic flusher and batch commits can write them
+ * back. To make room in a full table a data block is written back if
+ * there is one. Otherwise the oldest metadata block is forgotten and left
+ * for the block cache to write when it evicts it. Metadata blocks may be
+ * held by the caller, so they are never fetched for write back here. With
+ * the sync metadata option the forgotten block is moved to a pending list
+ * instead, which commit_batch() writes before it replies.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include <time.h>
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Initialize the dirty block table
+ *
+ */
+void init_dirty_blocks(void)
+{
+  LIST_INIT(&free_dirty_block_list);
+  LIST_INIT(&dirty_block_list);
+
+  nr_dirty_blocks = 0;
+
+  for (int t = 0; t < NR_DIRTY_BLOCKS; t++) {
+    dirty_block_table[t].block = NO_BLOCK;
+    LIST_ADD_TAIL(&free_dirty_block_list, &dirty_block_table[t], lru_link);
+  }
+
+  for (int t = 0; t < DIRTY_BLOCK_HASH_SIZE; t++) {
+    LIST_INIT(&dirty_block_hash[t]);
+  }
+}
+
+
+/* @brief   Record that a file data block has been marked dirty in the block cache
+ *
+ * @param   block, block number that has been marked dirty
+ */
+void dirty_block_enter(block_t block)
+{
+  mark_dirty_block(block, DB_DATA);
+}
+
+
+/* @brief   Record that a metadata block has been marked dirty in the block cache
+ *
+ * @param   block, block number that has been marked dirty
+ * @param   type, DB_BITMAP, DB_INDIRECT, DB_INODE_TABLE or DB_DIRECTORY
+ */
+void dirty_meta_enter(block_t block, int type)
+{
+  mark_dirty_block(block, type);
+}
+
+
+/* @brief   Enter a block into the dirty block table
+ *
+ * @param   block, block number that has been marked dirty
+ * @param   type, DB_DATA for file data, otherwise the type of metadata block
+ *
+ * If the table is full the least recently dirtied data block is written
+ * back to make room. If there is none the least recently dirtied metadata
+ * block is forgotten, and with the sync metadata option added to the
+ * commit pending list. The time a block was first dirtied is kept until
+ * it is written back.
+ */
+void mark_dirty_block(block_t block, int type)
+{
+  struct dirty_block *db;
+  int h;
+
+  if ((db = dirty_block_lookup(block)) != NULL) {
+    db->type = type;
+    LIST_REM_ENTRY(&dirty_block_list, db, lru_link);
+    LIST_ADD_TAIL(&dirty_block_list, db, lru_link);
+    return;
+  }
+
+  if (LIST_EMPTY(&free_dirty_block_list)) {
+    db = LIST_HEAD(&dirty_block_list);
+
+    while (db != NULL && db->type != DB_DATA) {
+      db = LIST_NEXT(db, lru_link);
+    }
+
+    if (db != NULL) {
+      writeback_dirty_block(db);
+    } else {
+      db = LIST_HEAD(&dirty_block_list);
+
+      if (config.sync_metadata) {
+        if (nr_commit_pending < NR_COMMIT_PENDING) {
+          commit_pending[nr_commit_pending].block = db->block;
+          commit_pending[nr_commit_pending].type = db->type;
+          nr_commit_pending++;
+        } else {
+          log_warn("extfs: commit pending list full, block %u not committed", (uint32_t)db->block);
+        }
+      }
+
+      dirty_block_remove(db->block);
+    }
+  }
+
+  db = LIST_HEAD(&free_dirty_block_list);
+  LIST_REM_HEAD(&free_dirty_block_list, lru_link);
+
+  db->block = block;
+  db->type = type;
+  db->dirtied = time(NULL);
+  h = block % DIRTY_BLOCK_HASH_SIZE;
+  LIST_ADD_HEAD(&dirty_block_hash[h], db, hash_link);
+  LIST_ADD_TAIL(&dirty_block_list, db, lru_link);
+  nr_dirty_blocks++;
+}
+
+
+/* @brief   Find a block in the dirty block table
+ *
+ * @param   block, block number to search for
+ * @return  pointer to the table entry or NULL if the block is not dirty
+ */
+struct dirty_block *dirty_block_lookup(block_t block)
+{
+  struct dirty_block *db;
+  int h;
+
+  h = block % DIRTY_BLOCK_HASH_SIZE;
+  db = LIST_HEAD(&dirty_block_hash[h]);
+
+  while (db != NULL) {
+    if (db->block == block) {
+      return db;
+    }
+
+    db = LIST_NEXT(db, hash_link);
+  }
+
+  return NULL;
+}
+
+
+/* @brief   Remove a block from the dirty block table
+ *
+ * @param   block, block number that has been freed or overwritten on disk
+ */
+void dirty_block_remove(block_t block)
+{
+  struct dirty_block *db;
+  int h;
+
+  if ((db = dirty_block_lookup(block)) == NULL) {
+    return;
+  }
+
+  h = block % DIRTY_BLOCK_HASH_SIZE;
+  LIST_REM_ENTRY(&dirty_block_hash[h], db, hash_link);
+  LIST_REM_ENTRY(&dirty_block_list, db, lru_link);
+  db->block = NO_BLOCK;
+  LIST_ADD_HEAD(&free_dirty_block_list, db, lru_link);
+  nr_dirty_blocks--;
+}
+
+
+/* @brief   Write a dirty block to disk and remove it from the dirty block table
+ *
+ * @param   db, dirty block table entry to write back
+ *
+ * The block is written directly to the device. A file data block is then
+ * invalidated in the block cache so that the cache does not write it a
+ * second time. Metadata blocks are read again soon, so they are kept
+ * cached, see writeback_keep_cached().
+ */
+void writeback_dirty_block(struct dirty_block *db)
+{
+  struct buf *bp;
+  block_t block;
+  ssize_t sz;
+
+  block = db->block;
+
+  bp = get_block(cache, block, BLK_READ);
+
+  if (bp == NULL) {
+    panic("extfs: failed to get dirty block %u for writeback", (uint32_t)block);
+  }
+
+  if (lseek64(block_fd, (off64_t)block * sb_block_size, SEEK_SET) == -1) {
+    panic("extfs: failed to seek to block %u for writeback", (uint32_t)block);
+  }
+
+  sz = write(block_fd, bp->data, sb_block_size);
+
+  if (sz != sb_block_size) {
+    panic("extfs: failed to write back block %u, sz:%d", (uint32_t)block, sz);
+  }
+
+  put_block(cache, bp);
+
+  if (writeback_keep_cached(db) == false) {
+    invalidate_block(cache, block);
+  }
+
+  dirty_block_remove(block);
+}
+
+
+/* @brief   Write a run of physically contiguous dirty blocks with one write
+ *
+ * @param   blocks, consecutive block numbers in the dirty block table
+ * @param   n, number of blocks, no more than fit in the coalesce buffer
+ *
+ * The blocks are copied out of the block cache into the coalesce buffer
+ * and written to the device together. File data blocks are then
+ * invalidated in the block cache so that the cache does not write them a
+ * second time, metadata blocks are kept cached.
+ */
+void writeback_dirty_run(block_t *blocks, uint32_t n)
+{
+  struct buf *bp;
+  ssize_t sz;
+
+  for (uint32_t t = 0; t < n; t++) {
+    if ((bp = get_block(cache, blocks[t], BLK_READ)) == NULL) {
+      panic("extfs: failed to get dirty block %u for writeback", (uint32_t)blocks[t]);
+    }
+
+    memcpy(coalesce_buf + t * sb_block_size, bp->data, sb_block_size);
+    put_block(cache, bp);
+  }
+
+  if (lseek64(block_fd, (off64_t)blocks[0] * sb_block_size, SEEK_SET) == -1) {
+    panic("extfs: failed to seek to block %u for writeback", (uint32_t)blocks[0]);
+  }
+
+  sz = write(block_fd, coalesce_buf, n * sb_block_size);
+
+  if (sz != n * sb_block_size) {
+    panic("extfs: failed to write back blocks %u-%u, sz:%d", (uint32_t)blocks[0],
+          (uint32_t)blocks[n - 1], sz);
+  }
+
+  for (uint32_t t = 0; t < n; t++) {
+    if (writeback_keep_cached(dirty_block_lookup(blocks[t])) == false) {
+      invalidate_block(cache, blocks[t]);
+    }
+
+    dirty_block_remove(blocks[t]);
+  }
+}
+
+
+/* @brief   Check if a block just written back should stay in the block cache
+ *
+ * @param   db, dirty block table entry of the block, or NULL if it has none
+ * @return  true to keep the cached copy, false to invalidate it
+ *
+ * The cached copy is what was just written so it is never stale here.
+ * Bitmaps, indirect, inode-table and directory blocks are kept cached as
+ * they are looked at again by the next allocation, lookup or inode load.
+ * The block cache has no way to mark a buffer clean, so it may write one
+ * of these again when it evicts it, which costs a write but no read.
+ * File data blocks are mostly read past the cache by read_run(), so they
+ * are invalidated to spare the cache that second write.
+ */
+bool writeback_keep_cached(struct dirty_block *db)
+{
+  return (db != NULL && db->type != DB_DATA);
+}
+
+
+/* @brief   Write the metadata blocks of one type on the commit pending list
+ *
+ * @param   type, DB_BITMAP, DB_INDIRECT, DB_INODE_TABLE or DB_DIRECTORY
+ *
+ * Called by commit_batch() between messages, when no blocks are held. A
+ * block dirtied again since it was pushed out of the table is skipped, it
+ * is written with the rest of the table.
+ */
+void writeback_commit_pending(int type)
+{
+  struct buf *bp;
+  block_t block;
+  ssize_t sz;
+
+  for (int t = 0; t < nr_commit_pending; t++) {
+    block = commit_pending[t].block;
+
+    if (commit_pending[t].type != type || dirty_block_lookup(block) != NULL) {
+      continue;
+    }
+
+    if ((bp = get_block(cache, block, BLK_READ)) == NULL) {
+      panic("extfs: failed to get pending block %u for commit", (uint32_t)block);
+    }
+
+    if (lseek64(block_fd, (off64_t)block * sb_block_size, SEEK_SET) == -1) {
+      panic("extfs: failed to seek to block %u for commit", (uint32_t)block);
+    }
+
+    sz = write(block_fd, bp->data, sb_block_size);
+
+    if (sz != sb_block_size) {
+      panic("extfs: failed to commit block %u, sz:%d", (uint32_t)block, sz);
+    }
+
+    put_block(cache, bp);
+  }
+}
@@ -38,6 +38,9 @@
  */
 typedef uint32_t bitchunk_t;
 LIST_TYPE(inode, inode_list_t, inode_link_t);
+LIST_TYPE(dirty_block, dirty_block_list_t, dirty_block_link_t);
+LIST_TYPE(file_cache_entry, file_cache_list_t, file_cache_link_t);
+LIST_TYPE(delalloc_block, delalloc_list_t, delalloc_link_t);
 
 /*
  * Driver Configuration settings
@@ -48,6 +51,20 @@ struct Config
   gid_t gid;
   mode_t mode;
   bool read_only;  
+  bool direct_io;               /* bypass block cache for large aligned requests */
+  size_t direct_io_min_size;    /* smallest request size to use direct I/O for */
+  uint32_t max_readahead_blocks;  /* largest readahead window in blocks */
+  uint32_t indirect_prefetch_pct; /* how far into an indirect block to prefetch the next */
+  size_t file_cache_size;       /* memory to use for caching small files */
+  size_t file_cache_max_file_size;  /* largest file to cache whole */
+  uint32_t lookup_prefetch_blocks;  /* blocks to prefetch when a file is looked up, 0 to disable */
+  bool delalloc;                /* delay allocating blocks for file data until flushed */
+  bool zero_detect;             /* leave whole blocks of zeroes written to files as holes */
+  uint32_t dirty_expire_secs;   /* age at which the flusher writes back a dirty block */
+  uint32_t dirty_ratio;         /* percent of the dirty block table the flusher leaves dirty */
+  uint32_t dirty_soft_limit;    /* dirty blocks above which write back runs between messages */
+  uint32_t dirty_hard_limit;    /* dirty blocks at which writes are deferred */
+  bool sync_metadata;           /* reply to metadata operations once committed to disk */
   char *mount_path;
 	char *device_path;
 };
@@ -57,10 +74,47 @@ struct Config
  * Config settings, tweak as needed
  */
 #define NR_CACHE_BLOCKS         128     /* Keep 128 blocks in the local block cache */
-#define NR_READAHEAD_BLOCKS      16     /* Number of blocks to read ahead */
+#define MIN_READAHEAD_WINDOW      4     /* Initial readahead window on sequential access */
+#define MAX_READAHEAD_WINDOW     32     /* Default largest readahead window */
+#define NR_READAHEAD_REQS         8     /* Size of the asynchronous readahead queue */
+#define READAHEAD_SLICE_BLOCKS    8     /* Blocks read ahead between checks for messages */
+#define RECLAIM_SLICE_BLOCKS      256   /* Blocks of an orphan freed between checks for messages */
+#define ORPHAN_RETRY_SECS          5    /* Back off after an orphan could not be loaded or truncated */
+#define UNINIT_SLICE_BLOCKS       256   /* Unwritten blocks zeroed between checks for messages */
+#define DIRTY_INODE_FLUSH_COUNT   (NR_INODES / 4)  /* Dirty inodes that trigger a write back */
+#define INDIRECT_PREFETCH_PCT    50     /* Default percent of an indirect block read before prefetching the next */
+#define LOOKUP_PREFETCH_BLOCKS    4     /* Default blocks prefetched when a file is looked up */
+#define LOOKUP_PREFETCH_TRIAL     8     /* Lookups in a directory before its hit rate is trusted */
+#define LOOKUP_PREFETCH_DECAY    64     /* Lookups in a directory at which its statistics are halved */
 #define NR_INODES                64     /* size of cached inode table */
+#define NR_BLOCK_RUNS             8     /* Cached logical-to-physical block runs per inode */
 #define INODE_HASH_SIZE         128
-#define BDFLUSH_INTERVAL_SECS    10
+#define NR_DIRTY_BLOCKS         256     /* File data blocks tracked as possibly dirty in the cache */
+#define DIRTY_BLOCK_HASH_SIZE    64
+#define COALESCE_BUF_SZ      0x20000    /* Largest single read or write of contiguous blocks */
+#define DIRECT_IO_MIN_SZ     0x10000    /* Default smallest request size for direct I/O */
+#define NR_DELALLOC_BLOCKS       64     /* Written but not yet allocated file blocks */
+#define DELALLOC_HASH_SIZE       32
+#define DELALLOC_LOW_SPACE      256     /* Free blocks below which allocation is not delayed */
+#define NR_RUN_ORDERS            14     /* Buckets in a group's free run length histogram */
+#define ALLOC_RUN_SEARCH_LEN     64     /* Longest free run searched for before taking the first free block */
+#define DEFAULT_PREALLOC_WINDOW   8     /* Blocks reserved on append if the superblock gives none */
+#define MAX_PREALLOC_WINDOW      64     /* Largest number of blocks reserved on append */
+#define NR_HOLE_DESCS            32     /* Most holes reported in a sparse read reply */
+#define NR_FILE_CACHE_ENTRIES    64     /* Most small files cached whole */
+#define FILE_CACHE_HASH_SIZE     32
+#define FILE_CACHE_SZ        0x40000    /* Default memory used to cache small files */
+#define FILE_CACHE_MAX_FILE_SZ 0x2000    /* Default largest file cached whole */
+#define BDFLUSH_INTERVAL_SECS    10     /* Time between runs of the periodic flusher */
+#define BDFLUSH_TIMER_ID          1     /* kqueue ident of the flusher's timer */
+#define DIRTY_EXPIRE_SECS        30     /* Default age at which a dirty block is written back */
+#define DIRTY_RATIO              50     /* Default percent of the dirty block table kept dirty */
+#define DIRTY_SOFT_LIMIT         (NR_CACHE_BLOCKS / 2)      /* Default dirty blocks that start write back */
+#define DIRTY_HARD_LIMIT         (NR_CACHE_BLOCKS * 3 / 4)  /* Default dirty blocks that defer writes */
+#define WRITEBACK_SLICE_BLOCKS   16     /* Dirty blocks written back between checks for messages */
+#define NR_DEFERRED_WRITES       16     /* Writes queued while over the hard dirty limit */
+#define NR_COMMIT_REPLIES        32     /* Replies held back until the end of a batch of messages */
+#define NR_COMMIT_PENDING        64     /* Metadata blocks pushed out of a full dirty block table awaiting commit */
 
 /*
  * Miscellaneous
@@ -187,7 +241,7 @@ struct Config
 #define EXT2_EA_INODE_FL          0x00200000 /* Inode used for large EA */
 #define EXT2_EOFBLOCKS_FL         0x00400000 /* Reserved for ext4 */
 #define EXT2_NOCOW_FL             0x00800000 /* Do not cow file */
-#define EXT2_DAX_FL               0x02000000 /* Inode is DAX */
+#define EXT2_DAX_FL               0x02000000 /* Inode is DAX, extfs uses direct I/O */
 #define EXT2_INLINE_DATA_FL       0x10000000 /* Reserved for ext4 */
 #define EXT2_PROJINHERIT_FL       0x20000000 /* Create with parents projid */
 #define EXT2_CASEFOLD_FL          0x40000000 /* Folder is case insensitive */
@@ -394,6 +448,31 @@ struct ondisk_inode
 } __attribute__((packed));
 
 
+/*
+ * A run of contiguous file blocks, logical blocks [logical, logical + length)
+ * map to physical blocks [physical, physical + length). A physical block of
+ * NO_BLOCK describes a hole.
+ */
+struct block_run
+{
+  uint32_t  logical;
+  block_t   physical;
+  uint32_t  length;
+};
+
+
+/*
+ * A range of a file's logical blocks that is allocated but not yet written
+ */
+#define NR_UNINIT_RANGES  8
+
+struct uninit_range
+{
+  uint32_t  block_pos;
+  uint32_t  count;
+};
+
+
 /*
  * structure of an in-memory inode, containing the on-disk inode structure
  */
@@ -405,10 +484,167 @@ struct inode
 
   inode_link_t    i_hash_link;    /* hash list */
   inode_link_t    i_unused_link;  /* free and unused list */
+  inode_link_t    i_dirty_link;   /* dirty inode list */
   uint32_t				i_ino;                  /* inode number */
   int     				i_count;                /* Reference count of in-memory inode */
   int     				i_update;               /* ATIME, CTIME and MTIME to update when writing inode to disk */
   int     				i_dirty;                /* inode is dirty */
+
+  struct block_run i_runs[NR_BLOCK_RUNS]; /* cache of recently mapped block runs */
+  int             i_nr_runs;              /* number of valid entries in i_runs */
+  int             i_next_run;             /* next i_runs entry to replace */
+
+  off64_t         i_ra_next_pos;          /* position a sequential read would start at */
+  uint32_t        i_ra_window;            /* readahead window in blocks, 0 if random access */
+  uint32_t        i_ra_end;               /* logical block that readahead has been queued to */
+  uint32_t        i_ra_fetched;           /* logical block that readahead has read to */
+  uint32_t        i_ind_prefetched;       /* first logical block mapped by last prefetched indirect block */
+  block_t         i_last_alloc;           /* last block allocated, next is the allocation goal */
+  block_t         i_prealloc_block;       /* first block of preallocation window */
+  uint32_t        i_prealloc_count;       /* unused blocks left in preallocation window */
+  uint32_t        i_prealloc_window;      /* size of the last preallocation window */
+  delalloc_list_t i_delalloc_list;        /* written blocks not yet allocated */
+  uint32_t        i_delalloc_count;
+  ino_t           i_pf_dir;               /* directory this was looked up in, until first read */
+  uint32_t        i_pf_lookups;           /* directory: lookups of regular files */
+  uint32_t        i_pf_hits;              /* directory: lookups followed by a read from the start */
+  bool            i_orphan;               /* on the orphan list, i_dtime is the next orphan */
+  struct uninit_range i_uninit[NR_UNINIT_RANGES]; /* preallocated blocks that read as zeroes */
+  int             i_nr_uninit;
+};
+
+
+/*
+ * A hole reported to the VFS by a sparse read, offset is relative to the
+ * start of the client's buffer
+ */
+struct hole_desc
+{
+  uint64_t  offset;
+  uint64_t  length;
+};
+
+
+/*
+ * A range of a file's logical blocks waiting to be read ahead
+ */
+struct readahead_req
+{
+  ino_t     ino;
+  uint32_t  first;
+  uint32_t  nblocks;        /* 0 if the entry is free */
+  bool      indirect;       /* only read the indirect blocks mapping first */
+};
+
+
+/*
+ * Summary of the free space in a group's block bitmap
+ */
+#define GS_UNKNOWN        0     /* bitmap not yet summarized */
+#define GS_EXACT          1     /* summary matches the bitmap */
+#define GS_LOWER_BOUND    2     /* blocks freed since, runs may be longer */
+
+struct group_summary
+{
+  int       state;
+  uint32_t  largest_run;
+  uint16_t  run_histogram[NR_RUN_ORDERS];   /* free runs of 2^n to 2^(n+1)-1 blocks */
+};
+
+
+/*
+ * Blocks of one group waiting to be freed together
+ */
+#define FREE_BATCH_SZ     512
+
+struct free_batch
+{
+  int       group;          /* group of the blocks in the batch */
+  uint32_t  count;          /* blocks in the batch */
+  uint32_t  nfreed;         /* total blocks passed to free_batch_block() */
+  block_t   blocks[FREE_BATCH_SZ];
+};
+
+
+/*
+ * A block of file data that has been written but not yet allocated
+ */
+struct delalloc_block
+{
+  ino_t             ino;        /* NO_INODE if the entry is free */
+  uint32_t          block_pos;  /* logical block within the file */
+  time_t            dirtied;    /* when the buffer was first written */
+  uint8_t           *data;
+  delalloc_link_t   hash_link;
+  delalloc_link_t   lru_link;
+  delalloc_link_t   inode_link;
+};
+
+
+/*
+ * The complete contents of a small file
+ */
+struct file_cache_entry
+{
+  ino_t               ino;        /* NO_INODE if the entry is free */
+  off64_t             size;
+  uint8_t             *data;
+  file_cache_link_t   hash_link;
+  file_cache_link_t   lru_link;
+};
+
+
+/*
+ * A file data block that has been marked dirty in the block cache
+ */
+struct dirty_block
+{
+  block_t             block;
+  int                 type;         /* DB_DATA or the kind of metadata block */
+  time_t              dirtied;      /* when the block was first dirtied */
+  dirty_block_link_t  hash_link;
+  dirty_block_link_t  lru_link;
+};
+
+
+/*
+ * Dirty block types (dirty_block.type). A commit writes metadata blocks
+ * in this order so that nothing on disk refers to a block or inode that
+ * is not yet allocated there.
+ */
+#define DB_DATA         0     /* file data */
+#define DB_BITMAP       1     /* block or inode bitmap */
+#define DB_INDIRECT     2     /* indirect block of a file or directory */
+#define DB_INODE_TABLE  3     /* inode-table block */
+#define DB_DIRECTORY    4     /* directory block */
+
+
+/*
+ * A reply held back until the metadata it depends on is committed
+ */
+struct commit_reply
+{
+  int         port;
+  msgid_t     msgid;
+  int         status;
+  size_t      sz;
+  ioreply_t   reply;
+};
+
+struct commit_block
+{
+  block_t     block;
+  int         type;
+};
+
+
+/*
+ * A write deferred while there is too much dirty data
+ */
+struct deferred_write
+{
+  msgid_t     msgid;
+  iorequest_t req;
 };
 
 
@@ -527,16 +763,32 @@ struct dirent_buf
  */
 
 // bitmap.c
+int find_clear_bit(uint32_t *bitmap, uint32_t max_bits, uint32_t start_bit, uint32_t end_bit);
+uint32_t count_clear_bits(uint32_t *bitmap, uint32_t max_bits, uint32_t bit, uint32_t limit);
+int find_clear_run(uint32_t *bitmap, uint32_t max_bits, uint32_t start_bit, uint32_t len);
+void set_bits(uint32_t *bitmap, uint32_t bit, uint32_t len);
+void clear_bits(uint32_t *bitmap, uint32_t bit, uint32_t len);
 int alloc_bit(uint32_t *bitmap, uint32_t max_bits, uint32_t start_word);
+int alloc_bit_run(uint32_t *bitmap, uint32_t max_bits, uint32_t start_bit,
+                  uint32_t max_len, uint32_t *ret_len);
 int clear_bit(uint32_t *bitmap, int index);
 
 // block.c
 struct buf *new_block(struct inode *inode, off_t position);
+block_t map_new_block(struct inode *inode, off_t position);
 block_t read_map_entry(struct inode *inode, uint64_t position);
+block_t read_map_run(struct inode *inode, uint64_t position, uint32_t *ret_len);
+uint32_t calc_run_length(uint32_t *entries, uint32_t index, uint32_t nentries, bool swap);
 int enter_map_entry(struct inode *inode, off_t position, block_t new_block);
+int enter_map_run(struct inode *inode, off64_t position, block_t new_block, uint32_t len);
+block_t get_map_leaf(struct inode *inode, int depth, uint32_t *offs);
 int delete_map_entry(struct inode *inode, off_t position);
-int calc_block_indirection_offsets(uint32_t position, uint32_t *offs);
+uint32_t delete_map_range(struct inode *inode, uint64_t first, uint64_t end);
+bool delete_indirect_range(struct free_batch *fb, block_t block, int level,
+                           uint64_t start, uint64_t end);
+int calc_block_indirection_offsets(uint64_t position, uint32_t *offs);
 int get_indirect_blocks(struct inode *inode, int depth, uint32_t offs[4], uint32_t block[4]);
+off64_t seek_data_hole(struct inode *inode, off64_t position, int whence);
 uint32_t get_toplevel_indirect_block_entry(struct inode *inode, int depth);
 void set_toplevel_indirect_block_entry(struct inode *inode, int depth, uint32_t block);
 block_t read_indirect_block_entry(struct buf *bp, int index);
@@ -544,8 +796,16 @@ void write_indirect_block_entry(struct buf *bp, int wrindex, block_t block);
 bool is_empty_indirect_block(struct buf *bp);
 void zero_block(struct buf *bp);
 block_t alloc_block(struct inode *inode, block_t block);
+block_t alloc_blocks(struct inode *inode, block_t goal, uint32_t count, uint32_t *ret_count);
+block_t alloc_reserve_blocks(struct inode *inode, block_t goal, uint32_t count, uint32_t reserve,
+                             uint32_t *ret_count, uint32_t *ret_reserved);
+uint32_t claim_blocks(block_t block, uint32_t count);
 void free_block(block_t block);
+void init_free_batch(struct free_batch *fb);
+void free_batch_block(struct free_batch *fb, block_t block);
+void flush_free_batch(struct free_batch *fb);
 void check_block_number(struct group_desc *gd, block_t block);
+void check_block_range(struct group_desc *gd, block_t block, uint32_t len);
 
 // dir.c
 ssize_t get_dirents(struct inode *dino_nr, off64_t *cookie, char *buf, ssize_t sz);
@@ -558,6 +818,43 @@ int dirent_buf_add(struct dirent_buf *db, int ino_nr, char *name, int len);
 size_t dirent_buf_finish(struct dirent_buf *db);
 int strcmp_nz(char *s1_nz, char *s2, size_t s1_len);
 
+// bdflush.c
+void init_bdflush(void);
+void bdflush(bool all);
+uint32_t writeback_oldest(uint32_t nblocks);
+void writeback_metadata(int type);
+void writeback_blocks(uint32_t n);
+int cmp_block(const void *a, const void *b);
+
+// commit.c
+int commit_replymsg(int port, msgid_t id, int status, void *buf, size_t sz);
+void commit_batch(void);
+
+// delalloc.c
+void init_delalloc(void);
+void init_inode_delalloc(struct inode *inode);
+struct delalloc_block *delalloc_lookup(struct inode *inode, uint32_t block_pos);
+int write_delalloc(struct inode *inode, off64_t position, size_t off, size_t chunk_size,
+                   size_t msg_off, const uint8_t *src);
+struct delalloc_block *delalloc_enter(struct inode *inode, uint32_t block_pos);
+void delalloc_remove(struct inode *inode, struct delalloc_block *db);
+int flush_delalloc(struct inode *inode);
+void flush_expired_delalloc(time_t now);
+void discard_delalloc(struct inode *inode, uint32_t block_pos, uint32_t end_pos);
+void flush_all_delalloc(void);
+
+// dirty_blocks.c
+void init_dirty_blocks(void);
+void dirty_block_enter(block_t block);
+void dirty_meta_enter(block_t block, int type);
+void mark_dirty_block(block_t block, int type);
+struct dirty_block *dirty_block_lookup(block_t block);
+void dirty_block_remove(block_t block);
+void writeback_dirty_block(struct dirty_block *db);
+void writeback_dirty_run(block_t *blocks, uint32_t n);
+void writeback_commit_pending(int type);
+bool writeback_keep_cached(struct dirty_block *db);
+
 // dir_delete.c
 int dirent_delete(struct inode *dir_inode, char *name);
 int search_block_and_delete(struct inode *dir_inode, struct buf *bp, char *name);
@@ -583,6 +880,27 @@ int lookup_dir(struct inode *dir_inode, char *name, ino_t *numb);
 int lookup_dir_block(struct inode *dir_inode, struct buf *bp,
                      char *name, ino_t *ret_ino_nr);
 
+// fallocate.c
+void init_uninit(struct inode *inode);
+int fallocate_inode(struct inode *inode, off64_t offset, off64_t length);
+bool add_uninit(struct inode *inode, uint32_t block_pos, uint32_t count);
+bool is_uninit_block(struct inode *inode, uint32_t block_pos);
+void remove_uninit(struct inode *inode, uint32_t block_pos, uint32_t count);
+bool uninit_pending(void);
+struct inode *find_uninit_inode(void);
+void zero_uninit_slice(void);
+void release_uninit(struct inode *inode);
+void flush_uninit(struct inode *inode);
+void flush_all_uninit(void);
+int zero_uninit_blocks(struct inode *inode, uint32_t block_pos, uint32_t count);
+
+// file_cache.c
+void init_file_cache(void);
+struct file_cache_entry *get_file_cache_entry(struct inode *inode);
+int fill_file_cache_entry(struct inode *inode, struct file_cache_entry *fce);
+ssize_t read_file_cache(struct file_cache_entry *fce, size_t nbytes, off64_t position);
+void invalidate_file_cache(ino_t ino);
+
 // group_descriptors.c
 uint32_t ext2_count_dirs(struct superblock *sp);
 struct group_desc *get_group_desc(unsigned int bnum);
@@ -590,14 +908,24 @@ void copy_group_descriptors(struct group_desc *dest_array,
                             struct group_desc *source_array,
                             unsigned int ngroups);
 void gd_copy(struct group_desc *dest, struct group_desc *source);
-void group_descriptors_markdirty(void);
+void group_descriptors_markdirty(int group);
 void group_descriptors_markclean(void);
+bool is_gdt_block_dirty(uint32_t gdt_block);
+void write_group_descriptors(void);
 
 // init.c
 void init(int argc, char *argv[]);
 int process_args(int argc, char *argv[]);
+int parse_count(const char *arg, uint32_t max, uint32_t *ret);
 int detect_ext2fs_partition(void);
 
+// group_summary.c
+void init_group_summaries(void);
+void build_group_summary(int group, uint32_t *bitmap);
+void group_summary_freed(int group);
+bool group_may_have_run(int group, uint32_t len);
+int run_order(uint32_t len);
+
 // inode.c
 int new_inode(struct inode *dir_inode, char *name, mode_t mode, 
                         uid_t uid, gid_t gid, struct inode **res);
@@ -619,7 +947,10 @@ void put_inode(struct inode *inode);
 void update_times(struct inode *inode);
 void read_inode(struct inode *inode);
 void write_inode(struct inode *inode);
+void sync_inode(struct inode *inode);
 void inode_copy(struct ondisk_inode *dst, struct ondisk_inode *src);
+void flush_dirty_inodes(void);
+block_t inode_table_block(ino_t ino_nr, block_t *offset);
 void inode_markdirty(struct inode *inode);
 void inode_markclean(struct inode *inode);
 
@@ -639,6 +970,9 @@ void ext2_read(iorequest_t *req);
 void ext2_write(iorequest_t *req);
 void ext2_create(iorequest_t *req);
 void ext2_truncate(iorequest_t *req);
+void ext2_seek(iorequest_t *req);
+void ext2_punch(iorequest_t *req);
+void ext2_fallocate(iorequest_t *req);
 
 // ops_link.c
 void ext2_close(iorequest_t *req);
@@ -650,26 +984,80 @@ void ext2_unlink(iorequest_t *req);
 void ext2_chmod(iorequest_t *req);
 void ext2_chown(iorequest_t *req);
 
+// orphan.c
+void add_orphan(struct inode *inode);
+bool orphans_pending(void);
+void reclaim_orphans(void);
+
+// prealloc.c
+void init_prealloc(struct inode *inode);
+block_t alloc_file_blocks(struct inode *inode, off64_t position, uint32_t count, uint32_t *ret_count);
+uint32_t prealloc_window_size(struct inode *inode);
+void discard_prealloc(struct inode *inode);
+void discard_all_prealloc(void);
+void mask_prealloc(int group, uint32_t *bitmap, bool set);
+
 // read.c
 ssize_t read_file(ino_t ino_nr, size_t nrbytes, off64_t position);
 int read_chunk(struct inode *inode, off64_t position, size_t off, size_t chunk, size_t msg_off);
+ssize_t read_run(struct inode *inode, off64_t position, uint32_t nblocks,
+                 uint32_t min_blocks, size_t msg_off);
+ssize_t read_cached_run(struct inode *inode, off64_t position, uint32_t nblocks,
+                        uint32_t min_blocks, size_t msg_off);
+bool is_direct_io(struct inode *inode, off64_t position, size_t nbytes);
 int read_nonexistent_block(size_t msg_off, size_t len);
+ssize_t read_hole(struct inode *inode, off64_t position, size_t nbytes, size_t msg_off);
+bool enter_hole_desc(size_t msg_off, size_t len);
+
+// readahead.c
+void init_readahead(struct inode *inode);
+void update_readahead(struct inode *inode, off64_t position, size_t nbytes);
+void start_readahead(struct inode *inode);
+void queue_readahead(struct inode *inode, uint32_t first, uint32_t nblocks);
+void start_indirect_prefetch(struct inode *inode);
+bool queue_indirect_prefetch(struct inode *inode, uint32_t first);
+void start_lookup_prefetch(struct inode *dir_inode, struct inode *inode);
+void update_lookup_prefetch(struct inode *inode, off64_t position);
+bool readahead_pending(void);
+void run_readahead(void);
+void readahead_blocks(struct inode *inode, uint32_t first, uint32_t nblocks);
+
+// run_cache.c
+block_t lookup_run_cache(struct inode *inode, uint32_t block_pos, uint32_t *ret_len);
+void enter_run_cache(struct inode *inode, uint32_t block_pos, block_t block, uint32_t len);
+void invalidate_run_cache(struct inode *inode, uint32_t block_pos);
+void flush_run_cache(struct inode *inode);
 
 // superblock.c
 int read_superblock(void);
 void write_superblock(void);
+void superblock_markdirty(void);
 void super_copy(struct superblock *dest, struct superblock *source);
 
+// throttle.c
+uint32_t nr_dirty_data(void);
+bool writeback_pending(void);
+bool run_writeback(void);
+void throttle_write(iorequest_t *req);
+void run_deferred_writes(bool force);
+void fail_deferred_writes(int sc);
+
 // truncate.c
-int truncate_inode(struct inode *inode, ssize_t sz);
+int truncate_inode(struct inode *inode, off64_t sz);
+int punch_hole(struct inode *inode, off64_t offset, off64_t length);
+void zero_block_range(struct inode *inode, off64_t position, size_t len);
 
 // utility.c
 void determine_cpu_endianness(void);
 uint16_t bswap2(bool norm, uint16_t w);
 uint32_t bswap4(bool norm, uint32_t x);
+bool is_zero_block(const void *data, size_t len);
 
 // write.c
 ssize_t write_file(ino_t ino_nr, size_t nrbytes, off64_t position);
 int write_chunk(struct inode *inode, off64_t position, size_t off, size_t chunk, size_t msg_off);
+int write_zero_block(struct inode *inode, off64_t position, size_t msg_off);
+ssize_t write_run(struct inode *inode, off64_t position, uint32_t nblocks, size_t msg_off);
+void alloc_write_blocks(struct inode *inode, off64_t position, size_t nbytes);
 
 #endif
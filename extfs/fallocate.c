@@ -0,0 +1,410 @@
+/* This file handles preallocation of file blocks ahead of writes.
+ *
+ * A file that is to be written with a known size can have its blocks
+ * allocated and mapped in contiguous runs up front. Later writes to the
+ * range find their blocks already mapped and do not touch the allocator
+ * or the block bitmaps.
+ *
+ * The preallocated blocks still hold whatever was on the disk before, so
+ * each in-memory inode keeps a short list of ranges of logical blocks
+ * that have been allocated but not yet written. Reads of those blocks
+ * return zeroes and a partial write of one clears the rest of the block
+ * instead of reading it. An inode with unwritten blocks is not evicted
+ * from the inode cache. Once its last reference is released the main loop
+ * zeroes its unwritten blocks on disk, UNINIT_SLICE_BLOCKS at a time while
+ * no messages are waiting, and only then can it be evicted. Any that are
+ * still unwritten when the filesystem handler exits are zeroed then.
+ *
+ * A range that does not fit in a full list is never zeroed on the spot.
+ * Its blocks are freed instead, leaving a hole that reads as zeroes and
+ * is allocated again when it is written. The list is not kept on disk,
+ * so blocks unwritten at the time of a crash may show stale data.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Reset the list of unwritten ranges of an inode
+ *
+ * @param   inode, inode that has been loaded into the inode cache
+ */
+void init_uninit(struct inode *inode)
+{
+  inode->i_nr_uninit = 0;
+}
+
+
+/* @brief   Allocate and map the blocks of a range of a file
+ *
+ * @param   inode, inode of regular file
+ * @param   offset, start of the range
+ * @param   length, length of the range
+ * @return  0 on success, negative errno on failure
+ *
+ * Holes in the range are allocated in as few contiguous runs as possible
+ * and recorded as unwritten. Blocks that are already mapped are left
+ * alone. The file is extended to the end of the range if it is shorter.
+ */
+int fallocate_inode(struct inode *inode, off64_t offset, off64_t length)
+{
+  uint32_t block_pos;
+  uint32_t end_pos;
+  uint32_t len;
+  uint32_t count;
+  block_t block;
+  int sc;
+
+  if (!S_ISREG(inode->odi.i_mode)) {
+    return -EINVAL;
+  }
+
+  if (offset < 0 || length <= 0) {
+    return -EINVAL;
+  }
+
+  if (offset + length > sb_max_size) {
+    return -EFBIG;
+  }
+
+  invalidate_file_cache(inode->i_ino);
+
+  // Written blocks waiting for delayed allocation must not be mapped over
+  if ((sc = flush_delalloc(inode)) != 0) {
+    return sc;
+  }
+
+  block_pos = offset / sb_block_size;
+  end_pos = (offset + length + sb_block_size - 1) / sb_block_size;
+
+  while (block_pos < end_pos) {
+    block = read_map_run(inode, (off64_t)block_pos * sb_block_size, &len);
+
+    if (len == 0) {
+      return -EFBIG;
+    }
+
+    len = MIN(len, end_pos - block_pos);
+
+    if (block != NO_BLOCK) {
+      block_pos += len;
+      continue;
+    }
+
+    while (len > 0) {
+      block = alloc_file_blocks(inode, (off64_t)block_pos * sb_block_size, len, &count);
+
+      if (block == NO_BLOCK) {
+        return -ENOSPC;
+      }
+
+      if ((sc = enter_map_run(inode, (off64_t)block_pos * sb_block_size, block, count)) != 0) {
+        // Free the blocks that did not make it into the map
+        for (uint32_t t = 0; t < count; t++) {
+          if (read_map_entry(inode, (off64_t)(block_pos + t) * sb_block_size) != block + t) {
+            free_block(block + t);
+          } else if (add_uninit(inode, block_pos + t, 1) == false) {
+            delete_map_range(inode, block_pos + t, block_pos + t + 1);
+          }
+        }
+        return sc;
+      }
+
+      // With the list full the rest of the range is left as holes
+      if (add_uninit(inode, block_pos, count) == false) {
+        delete_map_range(inode, block_pos, block_pos + count);
+        block_pos = end_pos;
+        break;
+      }
+
+      block_pos += count;
+      len -= count;
+    }
+  }
+
+  if (offset + length > inode->odi.i_size) {
+    inode->odi.i_size = offset + length;
+  }
+
+  inode->i_update |= CTIME | MTIME;
+  inode_markdirty(inode);
+  return 0;
+}
+
+
+/* @brief   Record a range of a file's blocks as allocated but unwritten
+ *
+ * @param   inode, inode of file
+ * @param   block_pos, first logical block of the range
+ * @param   count, number of blocks in the range
+ * @return  true if recorded, false if the list is full and the caller
+ *          must free the blocks
+ *
+ * A range following on from the last one recorded extends it.
+ */
+bool add_uninit(struct inode *inode, uint32_t block_pos, uint32_t count)
+{
+  struct uninit_range *ur;
+
+  if (inode->i_nr_uninit > 0) {
+    ur = &inode->i_uninit[inode->i_nr_uninit - 1];
+
+    if (ur->block_pos + ur->count == block_pos) {
+      ur->count += count;
+      return true;
+    }
+  }
+
+  if (inode->i_nr_uninit == NR_UNINIT_RANGES) {
+    return false;
+  }
+
+  ur = &inode->i_uninit[inode->i_nr_uninit++];
+  ur->block_pos = block_pos;
+  ur->count = count;
+  return true;
+}
+
+
+/* @brief   Check if a block of a file is allocated but unwritten
+ *
+ * @param   inode, inode of file
+ * @param   block_pos, logical block within the file
+ * @return  true if the block must read as zeroes
+ */
+bool is_uninit_block(struct inode *inode, uint32_t block_pos)
+{
+  struct uninit_range *ur;
+
+  for (int t = 0; t < inode->i_nr_uninit; t++) {
+    ur = &inode->i_uninit[t];
+
+    if (block_pos >= ur->block_pos && block_pos - ur->block_pos < ur->count) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+/* @brief   Remove a range of blocks from the unwritten ranges of a file
+ *
+ * @param   inode, inode of file
+ * @param   block_pos, first logical block of the range
+ * @param   count, number of blocks in the range
+ *
+ * Called once the blocks have been written or freed. If a range has to
+ * be split and the list is full, the blocks of the part after the hole
+ * are freed, leaving a hole in their place.
+ */
+void remove_uninit(struct inode *inode, uint32_t block_pos, uint32_t count)
+{
+  struct uninit_range *ur;
+  uint64_t end;
+  uint64_t ur_end;
+
+  end = (uint64_t)block_pos + count;
+
+  for (int t = 0; t < inode->i_nr_uninit; t++) {
+    ur = &inode->i_uninit[t];
+    ur_end = (uint64_t)ur->block_pos + ur->count;
+
+    if (end <= ur->block_pos || block_pos >= ur_end) {
+      continue;
+    }
+
+    if (block_pos > ur->block_pos && end < ur_end) {
+      // Split in two, keeping the part before the removed blocks here
+      ur->count = block_pos - ur->block_pos;
+
+      if (inode->i_nr_uninit == NR_UNINIT_RANGES) {
+        delete_map_range(inode, end, ur_end);
+      } else {
+        inode->i_uninit[inode->i_nr_uninit].block_pos = end;
+        inode->i_uninit[inode->i_nr_uninit].count = ur_end - end;
+        inode->i_nr_uninit++;
+      }
+    } else if (block_pos > ur->block_pos) {
+      ur->count = block_pos - ur->block_pos;
+    } else if (end < ur_end) {
+      ur->count = ur_end - end;
+      ur->block_pos = end;
+    } else {
+      // Entirely removed, fill the slot with the last range and look again
+      *ur = inode->i_uninit[--inode->i_nr_uninit];
+      t--;
+    }
+  }
+}
+
+
+/* @brief   Check if there are unwritten blocks to zero in the background
+ *
+ * @return  true if an inode with no references left has unwritten blocks
+ */
+bool uninit_pending(void)
+{
+  return find_uninit_inode() != NULL;
+}
+
+
+/* @brief   Find an inode with no references left that has unwritten blocks
+ *
+ * @return  inode or NULL if there is none
+ */
+struct inode *find_uninit_inode(void)
+{
+  struct inode *inode;
+
+  for (int t = 0; t < NR_INODES; t++) {
+    inode = &inode_cache[t];
+
+    if (inode->i_ino != NO_ENTRY && inode->i_count == 0 && inode->i_nr_uninit > 0) {
+      return inode;
+    }
+  }
+
+  return NULL;
+}
+
+
+/* @brief   Perform one slice of zeroing of unwritten blocks
+ *
+ * Called from the main loop when there are no messages waiting. At most
+ * UNINIT_SLICE_BLOCKS blocks are zeroed from the end of the last range of
+ * an unused inode, so that it can eventually be evicted.
+ */
+void zero_uninit_slice(void)
+{
+  struct inode *inode;
+  struct uninit_range *ur;
+  uint32_t n;
+
+  if ((inode = find_uninit_inode()) == NULL) {
+    return;
+  }
+
+  ur = &inode->i_uninit[inode->i_nr_uninit - 1];
+  n = MIN(ur->count, UNINIT_SLICE_BLOCKS);
+  ur->count -= n;
+
+  // Blocks that could not be zeroed are freed so they still read as zeroes
+  if (zero_uninit_blocks(inode, ur->block_pos + ur->count, n) != 0) {
+    delete_map_range(inode, ur->block_pos + ur->count, (uint64_t)ur->block_pos + ur->count + n);
+  }
+
+  if (ur->count == 0) {
+    inode->i_nr_uninit--;
+  }
+}
+
+
+/* @brief   Free the unwritten blocks of a file, leaving holes
+ *
+ * @param   inode, inode of file leaving the inode cache
+ */
+void release_uninit(struct inode *inode)
+{
+  struct uninit_range *ur;
+
+  while (inode->i_nr_uninit > 0) {
+    ur = &inode->i_uninit[--inode->i_nr_uninit];
+    delete_map_range(inode, ur->block_pos, (uint64_t)ur->block_pos + ur->count);
+  }
+}
+
+
+/* @brief   Zero the unwritten blocks of a file on disk
+ *
+ * @param   inode, inode of file
+ */
+void flush_uninit(struct inode *inode)
+{
+  struct uninit_range *ur;
+
+  while (inode->i_nr_uninit > 0) {
+    ur = &inode->i_uninit[--inode->i_nr_uninit];
+
+    if (zero_uninit_blocks(inode, ur->block_pos, ur->count) != 0) {
+      delete_map_range(inode, ur->block_pos, (uint64_t)ur->block_pos + ur->count);
+    }
+  }
+}
+
+
+/* @brief   Zero the unwritten blocks of every file in the inode cache
+ *
+ * Called before the filesystem handler exits.
+ */
+void flush_all_uninit(void)
+{
+  for (int t = 0; t < NR_INODES; t++) {
+    if (inode_cache[t].i_ino != NO_ENTRY) {
+      flush_uninit(&inode_cache[t]);
+    }
+  }
+}
+
+
+/* @brief   Zero a range of a file's blocks on disk
+ *
+ * @param   inode, inode of file
+ * @param   block_pos, first logical block of the range
+ * @param   count, number of blocks in the range
+ * @return  0 on success, negative errno on failure
+ *
+ * Each physically contiguous run is written from a zeroed coalesce buffer
+ * straight to the device, bypassing the block cache as write_run() does.
+ */
+int zero_uninit_blocks(struct inode *inode, uint32_t block_pos, uint32_t count)
+{
+  block_t block;
+  uint32_t len;
+  size_t sz;
+  int sc;
+
+  memset(coalesce_buf, 0, COALESCE_BUF_SZ);
+
+  while (count > 0) {
+    block = read_map_run(inode, (off64_t)block_pos * sb_block_size, &len);
+
+    if (len == 0) {
+      break;
+    }
+
+    len = MIN(len, count);
+    len = MIN(len, COALESCE_BUF_SZ / sb_block_size);
+
+    if (block != NO_BLOCK) {
+      for (uint32_t t = 0; t < len; t++) {
+        invalidate_block(cache, block + t);
+        dirty_block_remove(block + t);
+      }
+
+      sz = len * sb_block_size;
+
+      if (lseek64(block_fd, (off64_t)block * sb_block_size, SEEK_SET) == -1) {
+        log_error("zero_uninit_blocks: lseek -EIO");
+        return -EIO;
+      }
+
+      sc = write(block_fd, coalesce_buf, sz);
+
+      if (sc != sz) {
+        log_error("zero_uninit_blocks: write -EIO, sc:%d", sc);
+        return -EIO;
+      }
+    }
+
+    block_pos += len;
+    count -= len;
+  }
+
+  return 0;
+}
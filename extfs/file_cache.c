@@ -0,0 +1,209 @@
+/* This file manages the cache of small file contents.
+ *
+ * The complete contents of recently read small regular files are kept in
+ * memory, keyed by inode number. A read of a cached file is served with a
+ * single writemsg, without walking the block map or touching the block
+ * cache. The cache is a fixed number of slots, each large enough for the
+ * largest file that may be cached, carved out of one buffer allocated at
+ * mount time. Writes, truncation and freeing of an inode discard its
+ * cached contents.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include <sys/mman.h>
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Initialize the small file cache
+ *
+ * The number of slots is the configured cache size divided by the
+ * configured largest file size, limited to NR_FILE_CACHE_ENTRIES.
+ */
+void init_file_cache(void)
+{
+  struct file_cache_entry *fce;
+
+  LIST_INIT(&free_file_cache_list);
+  LIST_INIT(&file_cache_lru_list);
+
+  for (int t = 0; t < FILE_CACHE_HASH_SIZE; t++) {
+    LIST_INIT(&file_cache_hash[t]);
+  }
+
+  if (config.file_cache_max_file_size == 0) {
+    nr_file_cache_entries = 0;
+  } else {
+    nr_file_cache_entries = MIN(config.file_cache_size / config.file_cache_max_file_size,
+                                NR_FILE_CACHE_ENTRIES);
+  }
+
+  if (nr_file_cache_entries == 0) {
+    return;
+  }
+
+  file_cache_buf = mmap(NULL, nr_file_cache_entries * config.file_cache_max_file_size,
+                        PROT_READ | PROT_WRITE, 0, -1, 0);
+
+  if (file_cache_buf == NULL) {
+    panic("ext2fs can't allocate small file cache");
+  }
+
+  for (int t = 0; t < nr_file_cache_entries; t++) {
+    fce = &file_cache_table[t];
+    fce->ino = NO_INODE;
+    fce->size = 0;
+    fce->data = file_cache_buf + t * config.file_cache_max_file_size;
+    LIST_ADD_TAIL(&free_file_cache_list, fce, lru_link);
+  }
+}
+
+
+/* @brief   Get the cached contents of a file, caching it if needed
+ *
+ * @param   inode, inode of file being read
+ * @return  cache entry holding the file's contents or NULL if the file
+ *          is not suitable for caching
+ *
+ * On a miss the file is read into the least recently used slot through
+ * the block cache, so that blocks dirty in the block cache are seen.
+ */
+struct file_cache_entry *get_file_cache_entry(struct inode *inode)
+{
+  struct file_cache_entry *fce;
+  int h;
+
+  if (nr_file_cache_entries == 0 || !S_ISREG(inode->odi.i_mode)
+      || inode->odi.i_size <= 0 || inode->odi.i_size > config.file_cache_max_file_size
+      || inode->i_delalloc_count > 0) {
+    return NULL;
+  }
+
+  h = inode->i_ino % FILE_CACHE_HASH_SIZE;
+  fce = LIST_HEAD(&file_cache_hash[h]);
+
+  while (fce != NULL) {
+    if (fce->ino == inode->i_ino) {
+      LIST_REM_ENTRY(&file_cache_lru_list, fce, lru_link);
+      LIST_ADD_TAIL(&file_cache_lru_list, fce, lru_link);
+      return fce;
+    }
+
+    fce = LIST_NEXT(fce, hash_link);
+  }
+
+  if (LIST_EMPTY(&free_file_cache_list)) {
+    fce = LIST_HEAD(&file_cache_lru_list);
+    invalidate_file_cache(fce->ino);
+  }
+
+  fce = LIST_HEAD(&free_file_cache_list);
+
+  if (fill_file_cache_entry(inode, fce) != 0) {
+    return NULL;
+  }
+
+  LIST_REM_HEAD(&free_file_cache_list, lru_link);
+  fce->ino = inode->i_ino;
+  fce->size = inode->odi.i_size;
+  LIST_ADD_HEAD(&file_cache_hash[h], fce, hash_link);
+  LIST_ADD_TAIL(&file_cache_lru_list, fce, lru_link);
+  return fce;
+}
+
+
+/* @brief   Read the whole of a small file into a cache slot
+ *
+ * @param   inode, inode of file to read
+ * @param   fce, free cache entry to read the file into
+ * @return  0 on success, negative errno on failure
+ */
+int fill_file_cache_entry(struct inode *inode, struct file_cache_entry *fce)
+{
+  struct buf *bp;
+  block_t block;
+  off64_t position;
+  size_t chunk_size;
+
+  for (position = 0; position < inode->odi.i_size; position += chunk_size) {
+    chunk_size = MIN(sb_block_size, inode->odi.i_size - position);
+    block = read_map_entry(inode, position);
+
+    if (block == NO_BLOCK || is_uninit_block(inode, position / sb_block_size)) {
+      memset(fce->data + position, 0, chunk_size);
+      continue;
+    }
+
+    if ((bp = get_block(cache, block, BLK_READ)) == NULL) {
+      return -EIO;
+    }
+
+    memcpy(fce->data + position, bp->data, chunk_size);
+    put_block(cache, bp);
+  }
+
+  return 0;
+}
+
+
+/* @brief   Read from the cached contents of a file
+ *
+ * @param   fce, cache entry of the file
+ * @param   nbytes, number of bytes to read
+ * @param   position, offset in file to start reading from
+ * @return  number of bytes read or negative errno on failure
+ */
+ssize_t read_file_cache(struct file_cache_entry *fce, size_t nbytes, off64_t position)
+{
+  int sc;
+
+  if (position >= fce->size) {
+    return 0;
+  }
+
+  nbytes = MIN(nbytes, fce->size - position);
+  sc = writemsg(portid, msgid, fce->data + position, nbytes, 0);
+
+  if (sc != nbytes) {
+    log_error("read_file_cache: -EIO, sc= %d", sc);
+    return -EIO;
+  }
+
+  return nbytes;
+}
+
+
+/* @brief   Discard the cached contents of a file
+ *
+ * @param   ino, inode number of file that is being modified or freed
+ */
+void invalidate_file_cache(ino_t ino)
+{
+  struct file_cache_entry *fce;
+  int h;
+
+  if (nr_file_cache_entries == 0) {
+    return;
+  }
+
+  h = ino % FILE_CACHE_HASH_SIZE;
+  fce = LIST_HEAD(&file_cache_hash[h]);
+
+  while (fce != NULL) {
+    if (fce->ino == ino) {
+      LIST_REM_ENTRY(&file_cache_hash[h], fce, hash_link);
+      LIST_REM_ENTRY(&file_cache_lru_list, fce, lru_link);
+      fce->ino = NO_INODE;
+      fce->size = 0;
+      LIST_ADD_HEAD(&free_file_cache_list, fce, lru_link);
+      return;
+    }
+
+    fce = LIST_NEXT(fce, hash_link);
+  }
+}
+
@@ -19,11 +19,13 @@ msgid_t msgid;                      /* msgid of current message */
 bool be_cpu;                        /* true if cpu is big-endian and we should byte-swap fields */
 
 struct block_cache *cache;          /* file system block cache */
+int nr_readahead_blocks;            /* blocks read by get_block_readahead */
 struct superblock superblock;
 struct superblock ondisk_superblock;
 
 struct group_desc *group_descs;
 struct group_desc *ondisk_group_descs;
+uint32_t *gdt_dirty_map;
 
 uint32_t  sb_inodes_per_block;     /* Number of inodes per block */
 uint32_t  sb_inode_table_blocks_per_group;  /* Number of inode table blocks per group */
@@ -57,12 +59,52 @@ size_t    sb_inode_size;
 uint32_t  global_canary3[128];
 
 bool      sb_group_descriptors_dirty;
+bool      sb_superblock_dirty;
 
 const uint8_t zero_block_data[4096] = {0};
+bool sparse_read;
+struct hole_desc hole_descs[NR_HOLE_DESCS];
+int nr_hole_descs;
+uint8_t *coalesce_buf;
 
 inode_list_t unused_inode_list;
+inode_list_t dirty_inode_list;
+int nr_dirty_inodes;
 inode_list_t hash_inodes[INODE_HASH_SIZE];
 struct inode inode_cache[NR_INODES];
+dirty_block_list_t free_dirty_block_list;
+dirty_block_list_t dirty_block_list;
+dirty_block_list_t dirty_block_hash[DIRTY_BLOCK_HASH_SIZE];
+struct dirty_block dirty_block_table[NR_DIRTY_BLOCKS];
+uint32_t nr_dirty_blocks;
+block_t bdflush_blocks[NR_DIRTY_BLOCKS];
+
+struct deferred_write deferred_writes[NR_DEFERRED_WRITES];
+int deferred_write_head;
+int nr_deferred_writes;
+
+struct commit_reply commit_replies[NR_COMMIT_REPLIES];
+int nr_commit_replies;
+struct commit_block commit_pending[NR_COMMIT_PENDING];
+int nr_commit_pending;
+
+time_t orphan_retry_time;
+file_cache_list_t free_file_cache_list;
+file_cache_list_t file_cache_lru_list;
+file_cache_list_t file_cache_hash[FILE_CACHE_HASH_SIZE];
+struct file_cache_entry file_cache_table[NR_FILE_CACHE_ENTRIES];
+int nr_file_cache_entries;
+delalloc_list_t free_delalloc_list;
+delalloc_list_t delalloc_lru_list;
+delalloc_list_t delalloc_hash[DELALLOC_HASH_SIZE];
+struct delalloc_block delalloc_table[NR_DELALLOC_BLOCKS];
+uint8_t *delalloc_buf;
+uint32_t nr_delalloc_reserved;
+struct group_summary *group_summaries;
+uint8_t *file_cache_buf;
+struct readahead_req readahead_queue[NR_READAHEAD_REQS];
+int nr_readahead_reqs;
+int readahead_next;
 
 bool shutdown;
 
@@ -21,11 +21,13 @@ extern msgid_t msgid;               /* msgid of current message */
 extern bool be_cpu;                        /* true if cpu is big-endian and we should byte-swap fields */
 
 extern struct block_cache *cache;          /* file system block cache */
+extern int nr_readahead_blocks;            /* blocks read by get_block_readahead */
 extern struct superblock superblock;
 extern struct superblock ondisk_superblock;
 
 extern struct group_desc *group_descs;
 extern struct group_desc *ondisk_group_descs;
+extern uint32_t *gdt_dirty_map;
 
 extern uint32_t  sb_inodes_per_block;     /* Number of inodes per block */
 extern uint32_t  sb_inode_table_blocks_per_group; /* Number of inode table blocks per group */
@@ -63,15 +65,55 @@ extern uint32_t  sb_first_ino;
 extern size_t    sb_inode_size;
 
 extern bool      sb_group_descriptors_dirty;
+extern bool      sb_superblock_dirty;
 
   
 // Miscellaneous buffers
 extern const uint8_t zero_block_data[4096];
+extern bool sparse_read;
+extern struct hole_desc hole_descs[NR_HOLE_DESCS];
+extern int nr_hole_descs;
+extern uint8_t *coalesce_buf;
 
 // Lists
 extern inode_list_t unused_inode_list;
+extern inode_list_t dirty_inode_list;
+extern int nr_dirty_inodes;
 extern inode_list_t hash_inodes[INODE_HASH_SIZE];
 extern struct inode inode_cache[NR_INODES];
+extern dirty_block_list_t free_dirty_block_list;
+extern dirty_block_list_t dirty_block_list;
+extern dirty_block_list_t dirty_block_hash[DIRTY_BLOCK_HASH_SIZE];
+extern struct dirty_block dirty_block_table[NR_DIRTY_BLOCKS];
+extern uint32_t nr_dirty_blocks;
+extern block_t bdflush_blocks[NR_DIRTY_BLOCKS];
+
+extern struct deferred_write deferred_writes[NR_DEFERRED_WRITES];
+extern int deferred_write_head;
+extern int nr_deferred_writes;
+
+extern struct commit_reply commit_replies[NR_COMMIT_REPLIES];
+extern int nr_commit_replies;
+extern struct commit_block commit_pending[NR_COMMIT_PENDING];
+extern int nr_commit_pending;
+
+extern time_t orphan_retry_time;
+extern file_cache_list_t free_file_cache_list;
+extern file_cache_list_t file_cache_lru_list;
+extern file_cache_list_t file_cache_hash[FILE_CACHE_HASH_SIZE];
+extern struct file_cache_entry file_cache_table[NR_FILE_CACHE_ENTRIES];
+extern int nr_file_cache_entries;
+extern delalloc_list_t free_delalloc_list;
+extern delalloc_list_t delalloc_lru_list;
+extern delalloc_list_t delalloc_hash[DELALLOC_HASH_SIZE];
+extern struct delalloc_block delalloc_table[NR_DELALLOC_BLOCKS];
+extern uint8_t *delalloc_buf;
+extern uint32_t nr_delalloc_reserved;
+extern struct group_summary *group_summaries;
+extern uint8_t *file_cache_buf;
+extern struct readahead_req readahead_queue[NR_READAHEAD_REQS];
+extern int nr_readahead_reqs;
+extern int readahead_next;
 
 extern bool shutdown;
 
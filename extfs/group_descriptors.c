@@ -74,13 +74,89 @@ void gd_copy(struct group_desc *dest, struct group_desc *source)
 }
 
 
-void group_descriptors_markdirty(void)
+/* @brief   Mark the group descriptor table block holding a group as dirty
+ *
+ * @param   group, group whose descriptor has changed
+ */
+void group_descriptors_markdirty(int group)
 {
+  uint32_t gdt_block = group / sb_desc_per_block;
+  
+  gdt_dirty_map[gdt_block / 32] |= 1U << (gdt_block % 32);
   sb_group_descriptors_dirty = true;
 }
 
+
+/* @brief   Mark every group descriptor table block as clean
+ *
+ */
 void group_descriptors_markclean(void)
 {
+  memset(gdt_dirty_map, 0, ((sb_group_desc_block_count + 31) / 32) * sizeof (uint32_t));
   sb_group_descriptors_dirty = false;
 }
 
+
+/* @brief   Check if a group descriptor table block is dirty
+ *
+ * @param   gdt_block, index of block within the group descriptor table
+ * @return  true if a descriptor in the block has changed since it was written
+ */
+bool is_gdt_block_dirty(uint32_t gdt_block)
+{
+  return (gdt_dirty_map[gdt_block / 32] & (1U << (gdt_block % 32))) != 0;
+}
+
+
+/* @brief   Write the dirty blocks of the group descriptor table to disk
+ *
+ * Only the descriptors in dirty blocks are byte-swapped into the on-disk
+ * copy of the table. Consecutive dirty blocks are written with one write.
+ */
+void write_group_descriptors(void)
+{
+  uint32_t start;
+  uint32_t end;
+  uint32_t first;
+  uint32_t ngroups;
+  size_t sz;
+  ssize_t sc;
+  
+  if (sb_group_descriptors_dirty == false) {
+    return;
+  }
+
+  log_info("write group descriptors");
+  
+  for (start = 0; start < sb_group_desc_block_count; start = end) {
+    if (!is_gdt_block_dirty(start)) {
+      end = start + 1;
+      continue;
+    }
+
+    end = start + 1;
+
+    while (end < sb_group_desc_block_count && is_gdt_block_dirty(end)) {
+      end++;
+    }
+
+    first = start * sb_desc_per_block;
+    ngroups = MIN(end * sb_desc_per_block, sb_groups_count) - first;
+    sz = ngroups * sizeof (struct group_desc);
+
+    copy_group_descriptors(&ondisk_group_descs[first], &group_descs[first], ngroups);
+
+    if (lseek64(block_fd, sb_gdt_position + (uint64_t)start * sb_block_size, SEEK_SET) == -1) {
+      panic("ext2: failed to seek to group descriptors");
+    }
+
+    sc = write(block_fd, (char *)&ondisk_group_descs[first], sz);
+
+    if (sc != sz) {
+      panic("ext2: failed to write group descriptors, sc:%d", sc);
+    }
+  }
+  
+  group_descriptors_markclean();
+}
+
@@ -0,0 +1,120 @@
+/* This file maintains an in-memory summary of free space in each group.
+ *
+ * For each group the length of its largest free run of blocks and a
+ * histogram of free run lengths, bucketed by powers of two, are kept. A
+ * summary is built the first time the group's block bitmap is read by the
+ * allocator and rebuilt after each allocation from it. Freeing blocks can
+ * only make runs longer, so a free just marks the summary as a lower
+ * bound to be refreshed the next time the group's bitmap is read.
+ *
+ * The allocator uses the summaries to pass over groups that cannot hold
+ * a run of the size it wants without reading their bitmaps.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include <sys/mman.h>
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Allocate the group summaries, all initially unknown
+ *
+ * Called once the number of groups is known.
+ */
+void init_group_summaries(void)
+{
+  group_summaries = mmap(NULL, sb_groups_count * sizeof (struct group_summary),
+                         PROT_READ | PROT_WRITE, 0, -1, 0);
+
+  if (group_summaries == NULL) {
+    panic("ext2fs can't allocate group summaries");
+  }
+
+  for (int t = 0; t < sb_groups_count; t++) {
+    group_summaries[t].state = GS_UNKNOWN;
+  }
+}
+
+
+/* @brief   Rebuild the summary of a group from its block bitmap
+ *
+ * @param   group, group whose bitmap has been read
+ * @param   bitmap, contents of the group's block bitmap
+ */
+void build_group_summary(int group, uint32_t *bitmap)
+{
+  struct group_summary *gs = &group_summaries[group];
+  uint32_t max_bits = superblock.s_blocks_per_group;
+  uint32_t n;
+  int bit;
+
+  memset(gs->run_histogram, 0, sizeof gs->run_histogram);
+  gs->largest_run = 0;
+
+  bit = find_clear_bit(bitmap, max_bits, 0, max_bits);
+
+  while (bit != -1) {
+    n = count_clear_bits(bitmap, max_bits, bit, max_bits);
+    gs->run_histogram[run_order(n)]++;
+    gs->largest_run = MAX(gs->largest_run, n);
+    bit = find_clear_bit(bitmap, max_bits, bit + n, max_bits);
+  }
+
+  gs->state = GS_EXACT;
+}
+
+
+/* @brief   Record that blocks have been freed in a group
+ *
+ * @param   group, group containing the freed blocks
+ */
+void group_summary_freed(int group)
+{
+  if (group_summaries[group].state == GS_EXACT) {
+    group_summaries[group].state = GS_LOWER_BOUND;
+  }
+}
+
+
+/* @brief   Check if a group may contain a free run of a given length
+ *
+ * @param   group, group to check
+ * @param   len, length of free run wanted
+ * @return  false only if the group's summary shows that it has no free
+ *          run of len blocks, true if it has or if it is not known
+ */
+bool group_may_have_run(int group, uint32_t len)
+{
+  struct group_summary *gs = &group_summaries[group];
+
+  if (gs->state != GS_EXACT) {
+    return true;
+  }
+
+  // Any run in a higher bucket than len's is at least as long as len
+  for (int t = run_order(len) + 1; t < NR_RUN_ORDERS; t++) {
+    if (gs->run_histogram[t] != 0) {
+      return true;
+    }
+  }
+
+  return gs->largest_run >= len;
+}
+
+
+/* @brief   Get the histogram bucket for a free run length
+ *
+ * @param   len, length of a free run, at least 1
+ * @return  floor(log2(len)), limited to the last bucket
+ */
+int run_order(uint32_t len)
+{
+  int order = 31 - __builtin_clz(len);
+
+  return MIN(order, NR_RUN_ORDERS - 1);
+}
+
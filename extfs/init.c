@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include "ext2.h"
 #include "globals.h"
@@ -50,16 +51,8 @@ void init(int argc, char *argv[])
     panic("ext2fs failed to read superblock");
   }
 
-  int nr_readahead_blocks;
-  if (sb_block_size == 512) {
-    nr_readahead_blocks = 8;
-  } else if (sb_block_size == 1024) {
-    nr_readahead_blocks = 4;
-  } else if (sb_block_size == 2048) {
-    nr_readahead_blocks = 2;
-  } else {
-    nr_readahead_blocks = NR_READAHEAD_BLOCKS;
-  }
+  // Queued readahead is read a slice at a time
+  nr_readahead_blocks = READAHEAD_SLICE_BLOCKS;
   
   if ((cache = init_block_cache(block_fd, NR_CACHE_BLOCKS, sb_block_size, nr_readahead_blocks)) == NULL) {
     panic("ext2fs init block cache failed");
@@ -68,6 +61,17 @@ void init(int argc, char *argv[])
   if (init_inode_cache() != 0) {
     panic("ext2fs init inode cache failed");
   }
+
+  init_dirty_blocks();
+  init_group_summaries();
+  init_file_cache();
+  init_delalloc();
+  
+  coalesce_buf = mmap(NULL, COALESCE_BUF_SZ, PROT_READ | PROT_WRITE, 0, -1, 0);
+  
+  if (coalesce_buf == NULL) {
+    panic("ext2fs can't allocate coalesced read buffer");
+  }
   
   mnt_stat.st_dev = blk_stat.st_dev;
   mnt_stat.st_ino = EXT2_ROOT_INO;
@@ -101,23 +105,56 @@ void init(int argc, char *argv[])
  * -u default user-id
  * -g default gid
  * -m default mod bits
+ * -r read-only
+ * -D min-size, use direct I/O for block-aligned requests of at least min-size bytes
+ * -R blocks, largest adaptive readahead window, 0 to disable readahead
+ * -I percent, how far through an indirect block to prefetch the next
+ * -C bytes, memory used to cache small files whole
+ * -S bytes, largest file cached whole
+ * -P blocks, blocks prefetched when a file is looked up, 0 to disable
+ * -N disable delayed allocation
+ * -Z leave whole blocks of zeroes written to files as holes
+ * -E seconds, age at which the flusher writes back a dirty block
+ * -W percent, share of the dirty block table the flusher leaves dirty
+ * -L blocks, soft dirty limit above which write back runs between messages
+ * -H blocks, hard dirty limit at which writes are deferred
+ * -M reply to metadata operations only once they are committed to disk
+ *
+ * Numeric arguments must not be negative, values above an option's
+ * maximum are clamped to it.
+ *
  * mount path (default arg)
  * device path
  */
 int process_args(int argc, char *argv[])
 {
+  uint32_t val;
   int c;
   
   config.uid = 0;
   config.gid = 0;
   config.mode = 0700;
   config.read_only = false;
+  config.direct_io = false;
+  config.direct_io_min_size = DIRECT_IO_MIN_SZ;
+  config.max_readahead_blocks = MAX_READAHEAD_WINDOW;
+  config.indirect_prefetch_pct = INDIRECT_PREFETCH_PCT;
+  config.file_cache_size = FILE_CACHE_SZ;
+  config.file_cache_max_file_size = FILE_CACHE_MAX_FILE_SZ;
+  config.lookup_prefetch_blocks = LOOKUP_PREFETCH_BLOCKS;
+  config.delalloc = true;
+  config.zero_detect = false;
+  config.dirty_expire_secs = DIRTY_EXPIRE_SECS;
+  config.dirty_ratio = DIRTY_RATIO;
+  config.dirty_soft_limit = DIRTY_SOFT_LIMIT;
+  config.dirty_hard_limit = DIRTY_HARD_LIMIT;
+  config.sync_metadata = false;
   
   if (argc <= 1) {
     return -1;
   }
     
-  while ((c = getopt(argc, argv, "u:g:m:r")) != -1) {
+  while ((c = getopt(argc, argv, "u:g:m:rD:R:I:C:S:P:NZE:W:L:H:M")) != -1) {
     switch (c) {
       case 'u':
         config.uid = atoi(optarg);
@@ -134,12 +171,92 @@ int process_args(int argc, char *argv[])
       case 'r':
         config.read_only = true;
         break;
+
+      case 'D':
+        if (parse_count(optarg, UINT32_MAX, &val) != 0) {
+          return -1;
+        }
+        config.direct_io = true;
+        config.direct_io_min_size = val;
+        break;
+
+      case 'R':
+        if (parse_count(optarg, NR_CACHE_BLOCKS / 2, &config.max_readahead_blocks) != 0) {
+          return -1;
+        }
+        break;
+
+      case 'I':
+        if (parse_count(optarg, 100, &config.indirect_prefetch_pct) != 0) {
+          return -1;
+        }
+        break;
+
+      case 'C':
+        if (parse_count(optarg, UINT32_MAX, &val) != 0) {
+          return -1;
+        }
+        config.file_cache_size = val;
+        break;
+
+      case 'S':
+        if (parse_count(optarg, UINT32_MAX, &val) != 0) {
+          return -1;
+        }
+        config.file_cache_max_file_size = val;
+        break;
+
+      case 'P':
+        if (parse_count(optarg, NR_CACHE_BLOCKS / 16, &config.lookup_prefetch_blocks) != 0) {
+          return -1;
+        }
+        break;
+
+      case 'N':
+        config.delalloc = false;
+        break;
+
+      case 'Z':
+        config.zero_detect = true;
+        break;
+
+      case 'E':
+        if (parse_count(optarg, UINT32_MAX, &config.dirty_expire_secs) != 0) {
+          return -1;
+        }
+        break;
+
+      case 'W':
+        if (parse_count(optarg, 100, &config.dirty_ratio) != 0) {
+          return -1;
+        }
+        break;
+
+      case 'L':
+        if (parse_count(optarg, UINT32_MAX, &config.dirty_soft_limit) != 0) {
+          return -1;
+        }
+        break;
+
+      case 'H':
+        if (parse_count(optarg, UINT32_MAX, &config.dirty_hard_limit) != 0) {
+          return -1;
+        }
+        break;
+
+      case 'M':
+        config.sync_metadata = true;
+        break;
       
       default:
         break;
     }
   }
 
+  if (config.dirty_hard_limit < config.dirty_soft_limit) {
+    config.dirty_hard_limit = config.dirty_soft_limit;
+  }
+  
   if (optind + 1 >= argc) {
     return -1;
   }
@@ -150,3 +267,27 @@ int process_args(int argc, char *argv[])
 }
 
 
+/* @brief   Parse a numeric command line argument
+ *
+ * @param   arg, argument string
+ * @param   max, largest value allowed, larger values are clamped to it
+ * @param   ret, returns the value
+ * @return  0 on success, -1 if the argument is not a number or is negative
+ */
+int parse_count(const char *arg, uint32_t max, uint32_t *ret)
+{
+  char *end;
+  long long val;
+
+  val = strtoll(arg, &end, 0);
+
+  if (end == arg || *end != '\0' || val < 0) {
+    log_error("extfs: invalid option argument: %s", arg);
+    return -1;
+  }
+
+  *ret = (val > max) ? max : (uint32_t)val;
+  return 0;
+}
+
+
@@ -125,6 +125,11 @@ int alloc_inode(struct inode *parent_inode, mode_t mode, uid_t uid, gid_t gid, s
     inode->odi.i_block[i] = NO_BLOCK;
   }
 
+  flush_run_cache(inode);
+  init_readahead(inode);
+  init_prealloc(inode);
+  init_inode_delalloc(inode);
+
   inode_markdirty(inode);
 	*res = inode;
 	return 0;
@@ -146,6 +151,7 @@ void free_inode(struct inode *inode)
 	  return;
   }
   
+  invalidate_file_cache(inode->i_ino);
   free_inode_bit(b, S_ISDIR(inode->odi.i_mode));
   inode->odi.i_mode = 0;  
 }
@@ -205,6 +211,7 @@ uint32_t alloc_inode_bit(uint32_t group, bool is_dir)
 
   block_markdirty(bp);
   put_block(cache, bp);
+  dirty_meta_enter(gd->g_inode_bitmap, DB_BITMAP);
 
   gd->g_free_inodes_count--;
   superblock.s_free_inodes_count--;
@@ -214,7 +221,7 @@ uint32_t alloc_inode_bit(uint32_t group, bool is_dir)
 	  sb_dirs_counter++;
   }
 
-  group_descriptors_markdirty();
+  group_descriptors_markdirty(group);
 
   return ino_nr;
 }
@@ -255,6 +262,7 @@ void free_inode_bit(uint32_t ino_nr, bool is_dir)
   
   block_markdirty(bp);
   put_block(cache, bp);
+  dirty_meta_enter(gd->g_inode_bitmap, DB_BITMAP);
 
   gd->g_free_inodes_count++;
   superblock.s_free_inodes_count++;
@@ -264,7 +272,7 @@ void free_inode_bit(uint32_t ino_nr, bool is_dir)
     sb_dirs_counter--;
   }
 
-  group_descriptors_markdirty();
+  group_descriptors_markdirty(group);
 }
 
 
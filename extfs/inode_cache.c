@@ -21,6 +21,8 @@
 int init_inode_cache(void)
 {
   LIST_INIT(&unused_inode_list);
+  LIST_INIT(&dirty_inode_list);
+  nr_dirty_inodes = 0;
   
   log_debug("init_inode_cache(), sizeof inode=%d", sizeof (struct inode));
   
@@ -96,20 +98,55 @@ struct inode *get_inode(ino_t ino_nr)
   	return NULL;
   }
 
+  // An inode whose delayed blocks cannot be allocated is passed over,
+  // evicting it would lose their data. So is one with unwritten blocks
+  // that zero_uninit_slice() has not zeroed yet.
   inode = LIST_HEAD(&unused_inode_list);
 
+  while (inode != NULL && inode->i_ino != NO_ENTRY
+         && (inode->i_nr_uninit > 0 || flush_delalloc(inode) != 0)) {
+    inode = LIST_NEXT(inode, i_unused_link);
+  }
+
+  // Failing that, one with unwritten blocks is evicted and they are freed
+  if (inode == NULL) {
+    inode = LIST_HEAD(&unused_inode_list);
+
+    while (inode != NULL && flush_delalloc(inode) != 0) {
+      inode = LIST_NEXT(inode, i_unused_link);
+    }
+  }
+
+  if (inode == NULL) {
+  	log_warn("..get_inode() found no inode that could be evicted");
+  	return NULL;
+  }
+
   if (inode->i_ino != NO_ENTRY) {
+    discard_prealloc(inode);
+    release_uninit(inode);
+
+    if (inode->i_dirty == true) {
+      write_inode(inode);
+    }
+
   	unhash_inode(inode);
   }
   
-  LIST_REM_HEAD(&unused_inode_list, i_unused_link);
+  LIST_REM_ENTRY(&unused_inode_list, inode, i_unused_link);
 
   inode->i_ino = ino_nr;
   inode->i_count = 1;
 
   read_inode(inode);
+  flush_run_cache(inode);
+  init_readahead(inode);
+  init_prealloc(inode);
+  init_inode_delalloc(inode);
+  init_uninit(inode);
 
   inode->i_update = 0;
+  inode->i_orphan = false;
   
   addhash_inode(inode);
 
@@ -161,27 +198,27 @@ void put_inode(struct inode *inode)
   inode->i_count--;
   
   if (inode->i_count == 0) {
-	  if (inode->odi.i_links_count == 0) {
-		  truncate_inode(inode, (off_t) 0);
-		  inode_markdirty(inode);
-		  free_inode(inode);
+	  // Blocks of an unlinked inode are freed later by reclaim_orphans()
+	  if (inode->odi.i_links_count == 0 && inode->odi.i_mode != 0 && inode->i_orphan == false) {
+		  discard_delalloc(inode, 0, UINT32_MAX);
+		  discard_prealloc(inode);
+		  init_uninit(inode);
+		  add_orphan(inode);
 	  }
 	  
-	  if (inode->i_dirty == true) {
-	    write_inode(inode);
-    }
-    
-	  if (inode->odi.i_links_count == 0) {
+	  // A freed inode must reach its inode-table block before the cache
+	  // entry forgets its number, others are written back lazily
+	  if (inode->odi.i_links_count == 0 && inode->odi.i_mode == 0) {
+		  if (inode->i_dirty == true) {
+		    write_inode(inode);
+		  }
+		  
 		  unhash_inode(inode);
 		  inode->i_ino = NO_ENTRY;
 		  LIST_ADD_HEAD(&unused_inode_list, inode, i_unused_link);
 	  } else {
 		  LIST_ADD_TAIL(&unused_inode_list, inode, i_unused_link);
 	  }
-  } else {
-	  if (inode->i_dirty == true) {
-	    write_inode(inode);
-    }  
   }
 }
 
@@ -230,24 +267,11 @@ void update_times(struct inode *inode)
 void read_inode(struct inode *inode)
 {
   struct buf *bp;
-  struct group_desc *gd;
   struct ondisk_inode *disk_inode;
-  uint32_t block_group_number;
   block_t b, offset;
 
-  block_group_number = (inode->i_ino - 1) / superblock.s_inodes_per_group;
-  gd = get_group_desc(block_group_number);
-
-  if (gd == NULL) {
-  	panic("can't get group_desc to read inode");
-  }
-  
-  offset = ((inode->i_ino - 1) % superblock.s_inodes_per_group) * sb_inode_size;
-  b = (block_t) gd->g_inode_table + (offset >> sb_blocksize_bits);
-  
+  b = inode_table_block(inode->i_ino, &offset);
   bp = get_block(cache, b, BLK_READ);
-
-  offset &= (sb_block_size - 1);
   disk_inode = (struct ondisk_inode*) ((uint8_t *)bp->data + offset);
 
   inode_copy(&inode->odi, disk_inode);
@@ -275,25 +299,11 @@ void read_inode(struct inode *inode)
 void write_inode(struct inode *inode)
 {
   struct buf *bp;
-  struct group_desc *gd;
   struct ondisk_inode *disk_inode;
-  uint32_t block_group_number;
   block_t b, offset;
 
-	
-  block_group_number = (inode->i_ino - 1) / superblock.s_inodes_per_group;
-  gd = get_group_desc(block_group_number);
-
-  if (gd == NULL) {
-  	panic("can't get group_desc to write inode");
-  }
-  
-  offset = ((inode->i_ino - 1) % superblock.s_inodes_per_group) * sb_inode_size;
-  b = (block_t) gd->g_inode_table + (offset >> sb_blocksize_bits);
-  
+  b = inode_table_block(inode->i_ino, &offset);
   bp = get_block(cache, b, BLK_READ);
-
-  offset &= (sb_block_size - 1);
   disk_inode = (struct ondisk_inode*) ((uint8_t *)bp->data + offset);
 
   if (inode->i_update) {
@@ -304,6 +314,7 @@ void write_inode(struct inode *inode)
   	  
   if (config.read_only == false) {
 	  block_markdirty(bp);
+	  dirty_meta_enter(b, DB_INODE_TABLE);
 	}
   log_debug("inode nr        = %d", inode->i_ino);
   log_debug("inode->odi.i_links_count = %08x", inode->odi.i_links_count);
@@ -322,6 +333,97 @@ void write_inode(struct inode *inode)
 }
 
 
+/* @brief   Write an inode to disk and write back its inode-table block
+ *
+ * @param   inode, pointer to inode
+ *
+ * Used where the inode must be on disk before a later write that depends
+ * on it, such as the superblock write that links it into the orphan list.
+ */
+void sync_inode(struct inode *inode)
+{
+  struct dirty_block *db;
+  block_t b, offset;
+
+  write_inode(inode);
+  b = inode_table_block(inode->i_ino, &offset);
+
+  if ((db = dirty_block_lookup(b)) != NULL) {
+    writeback_dirty_block(db);
+  }
+}
+
+
+
+/* @brief   Write back all dirty inodes
+ *
+ * Dirty inodes that share an inode-table block are copied into it
+ * together, so the block is fetched and marked dirty once for all of
+ * them rather than once per inode.
+ */
+void flush_dirty_inodes(void)
+{
+  struct inode *inode;
+  struct inode *next;
+  struct ondisk_inode *disk_inode;
+  struct buf *bp;
+  block_t b, offset;
+
+  while ((inode = LIST_HEAD(&dirty_inode_list)) != NULL) {
+    b = inode_table_block(inode->i_ino, &offset);
+    bp = get_block(cache, b, BLK_READ);
+
+    while (inode != NULL) {
+      next = LIST_NEXT(inode, i_dirty_link);
+
+      if (inode_table_block(inode->i_ino, &offset) == b) {
+        disk_inode = (struct ondisk_inode*) ((uint8_t *)bp->data + offset);
+
+        if (inode->i_update) {
+          update_times(inode);
+        }
+
+        inode_copy(disk_inode, &inode->odi);
+        inode_markclean(inode);
+      }
+
+      inode = next;
+    }
+
+    if (config.read_only == false) {
+      block_markdirty(bp);
+      dirty_meta_enter(b, DB_INODE_TABLE);
+    }
+
+    put_block(cache, bp);
+  }
+}
+
+
+/* @brief   Find the inode-table block holding an inode
+ *
+ * @param   ino_nr, inode number
+ * @param   offset, returns the offset of the inode within the block
+ * @return  block number of the inode-table block
+ */
+block_t inode_table_block(ino_t ino_nr, block_t *offset)
+{
+  struct group_desc *gd;
+  uint32_t block_group_number;
+  block_t off;
+
+  block_group_number = (ino_nr - 1) / superblock.s_inodes_per_group;
+  gd = get_group_desc(block_group_number);
+
+  if (gd == NULL) {
+  	panic("can't get group_desc for inode");
+  }
+  
+  off = ((ino_nr - 1) % superblock.s_inodes_per_group) * sb_inode_size;
+  *offset = off & (sb_block_size - 1);
+  return (block_t) gd->g_inode_table + (off >> sb_blocksize_bits);
+}
+
 
 /* @brief   Copy on-disk inode structure in RAM and optionally swap bytes
  *
@@ -357,21 +459,40 @@ void inode_copy(struct ondisk_inode *dst, struct ondisk_inode *src)
 }
 
 
-/*
+/* @brief   Mark an inode as modified
  *
+ * @param   inode, inode to mark dirty
+ *
+ * The inode is queued on the dirty inode list and written to its
+ * inode-table block by flush_dirty_inodes(), or by write_inode() if it is
+ * evicted first. Callers may go on modifying an inode after marking it,
+ * so the list is only flushed between messages.
  */
 void inode_markdirty(struct inode *inode)
 {
+  if (inode->i_dirty == true) {
+    return;
+  }
+  
   inode->i_dirty = true;
+  LIST_ADD_TAIL(&dirty_inode_list, inode, i_dirty_link);
+  nr_dirty_inodes++;
 }
 
 
-/*
+/* @brief   Mark an inode as written back
  *
+ * @param   inode, inode that has been copied to its inode-table block
  */
 void inode_markclean(struct inode *inode)
 {
+  if (inode->i_dirty == false) {
+    return;
+  }
+  
   inode->i_dirty = false;
+  LIST_REM_ENTRY(&dirty_inode_list, inode, i_dirty_link);
+  nr_dirty_inodes--;
 }
 
 
@@ -19,9 +19,11 @@
 int main(int argc, char *argv[])
 {
   struct kevent ev;
+  struct timespec zero_timeout = {0, 0};
   iorequest_t req;
   int sc;
   int nevents;
+  bool writeback_stalled = false;
   struct sigaction sact;
   
   init(argc, argv);
@@ -37,9 +39,39 @@ int main(int argc, char *argv[])
   EV_SET(&ev, portid, EVFILT_MSGPORT, EV_ADD | EV_ENABLE, 0, 0, 0); 
   kevent(kq, &ev, 1, NULL, 0, NULL);
 
+  init_bdflush();
+
   while (!shutdown) {
-    nevents = kevent(kq, NULL, 0, &ev, 1, NULL);
+    // Poll for messages while there is write back, readahead, orphan
+    // reclamation or zeroing of unwritten blocks to do in the background.
+    // Write back that made no progress waits for a message or the flush
+    // timer before it is tried again.
+    if ((writeback_pending() && !writeback_stalled) || readahead_pending()
+        || orphans_pending() || uninit_pending()) {
+      nevents = kevent(kq, NULL, 0, &ev, 1, &zero_timeout);
+    } else {
+      nevents = kevent(kq, NULL, 0, &ev, 1, NULL);
+    }
+  
+    if (nevents == 0) {
+      if (writeback_pending() && !writeback_stalled) {
+        writeback_stalled = !run_writeback();
+      } else if (readahead_pending()) {
+        run_readahead();
+      } else if (orphans_pending()) {
+        reclaim_orphans();
+      } else {
+        zero_uninit_slice();
+      }
+      continue;
+    }
   
+    if (nevents == 1 && ev.ident == BDFLUSH_TIMER_ID && ev.filter == EVFILT_TIMER) {
+      bdflush(false);
+      writeback_stalled = false;
+      continue;
+    }
+    
     if (nevents == 1 && ev.ident == portid && ev.filter == EVFILT_MSGPORT) {
       while ((sc = getmsg(portid, &msgid, &req, sizeof req)) == sizeof req) {      
         switch (req.cmd) {
@@ -48,7 +80,7 @@ int main(int argc, char *argv[])
             break;
 
           case CMD_WRITE:
-            ext2_write(&req);
+            throttle_write(&req);
             break;
 
           case CMD_LOOKUP:
@@ -99,6 +131,18 @@ int main(int argc, char *argv[])
             ext2_truncate(&req);
             break;
 
+          case CMD_SEEK:
+            ext2_seek(&req);
+            break;
+
+          case CMD_PUNCH:
+            ext2_punch(&req);
+            break;
+
+          case CMD_FALLOCATE:
+            ext2_fallocate(&req);
+            break;
+
           // TODO: Add VNODEATTR
 
           default:
@@ -106,8 +150,19 @@ int main(int argc, char *argv[])
             replymsg(portid, msgid, -ENOTSUP, NULL, 0);
             break;
         }
+        
+        if (nr_dirty_inodes >= DIRTY_INODE_FLUSH_COUNT) {
+          flush_dirty_inodes();
+        }
       }
 
+      // Commit the metadata changed by this batch and send the replies
+      // that were waiting for it
+      commit_batch();
+
+      // Keep write back going while messages arrive without a break
+      writeback_stalled = writeback_pending() && !run_writeback();
+
       if (sc != 0) {
         log_error("ext2fs: getmsg err = %d, %s", sc, strerror(-sc));
         exit(-1);
@@ -115,6 +170,11 @@ int main(int argc, char *argv[])
     }
   }
 
+  run_deferred_writes(true);
+  commit_batch();
+  flush_all_delalloc();
+  flush_all_uninit();
+  bdflush(true);
   exit(0);
 }
 
@@ -61,6 +61,8 @@ void ext2_lookup(iorequest_t *req)
   reply.args.lookup.mtime = 0;
   reply.args.lookup.ctime = 0;
 
+  start_lookup_prefetch(dir_inode, inode);
+  
   put_inode(inode);
   put_inode(dir_inode);
 
@@ -172,7 +174,7 @@ void ext2_mkdir(iorequest_t *req)
 
   put_inode(inode);
 
-  replymsg(portid, msgid, 0, &reply, sizeof reply);  
+  commit_replymsg(portid, msgid, 0, &reply, sizeof reply);  
 }
 
 
@@ -242,7 +244,7 @@ void ext2_rmdir(iorequest_t *req)
   put_inode(inode);
   put_inode(dir_inode);
 
-  replymsg(portid, msgid, sc, NULL, 0);
+  commit_replymsg(portid, msgid, sc, NULL, 0);
 }
 
 
@@ -25,9 +25,21 @@ void ext2_read(iorequest_t *req)
   ino_nr = req->args.read.inode_nr;
   offset = req->args.read.offset;
   count = req->args.read.sz;
+
+  // A client that negotiates sparse reads is sent a list of the holes in
+  // the range read instead of the zeroes they contain.
+  sparse_read = (req->args.read.flags & READ_SPARSE) ? true : false;
+  nr_hole_descs = 0;
   
   nbytes_read = read_file(ino_nr, count, offset);
-  replymsg(portid, msgid, nbytes_read, NULL, 0);
+  
+  if (sparse_read && nbytes_read > 0) {
+    replymsg(portid, msgid, nbytes_read, hole_descs, nr_hole_descs * sizeof (struct hole_desc));
+  } else {
+    replymsg(portid, msgid, nbytes_read, NULL, 0);
+  }
+
+  sparse_read = false;
 }
 
 
@@ -101,7 +113,7 @@ void ext2_create(iorequest_t *req)
   put_inode(dir_inode);
   put_inode(inode);
 
-  replymsg(portid, msgid, 0, &reply, sizeof reply);
+  commit_replymsg(portid, msgid, 0, &reply, sizeof reply);
 } 
  
 
@@ -111,8 +123,107 @@ void ext2_create(iorequest_t *req)
  */
 void ext2_truncate(iorequest_t *req)
 {  
-  // TODO: FIXME:  sc = truncate_inode(struct inode *rip, off_t len)
-  replymsg(portid, msgid, 0, NULL, 0);
+  struct inode *inode;
+  int sc;
+  
+  if ((inode = get_inode(req->args.truncate.inode_nr)) == NULL) {
+  	log_error("ext2_truncate: -EINVAL");
+    replymsg(portid, msgid, -EINVAL, NULL, 0);
+	  return;
+  }
+
+  sc = truncate_inode(inode, req->args.truncate.size);
+  put_inode(inode);
+  commit_replymsg(portid, msgid, sc, NULL, 0);
+}
+
+
+/* @brief   Deallocate a range of a file, leaving a hole
+ *
+ * @param   req, message header received by getmsg.
+ *
+ * The size of the file is unchanged and the range reads back as zeroes,
+ * so this serves as both punch hole and zero range.
+ */
+void ext2_punch(iorequest_t *req)
+{
+  struct inode *inode;
+  int sc;
+  
+  if ((inode = get_inode(req->args.punch.inode_nr)) == NULL) {
+  	log_error("ext2_punch: -EINVAL");
+    replymsg(portid, msgid, -EINVAL, NULL, 0);
+	  return;
+  }
+
+  sc = punch_hole(inode, req->args.punch.offset, req->args.punch.length);
+  put_inode(inode);
+  commit_replymsg(portid, msgid, sc, NULL, 0);
 }
 
 
+/* @brief   Preallocate a range of a file
+ *
+ * @param   req, message header received by getmsg.
+ */
+void ext2_fallocate(iorequest_t *req)
+{
+  struct inode *inode;
+  int sc;
+  
+  if ((inode = get_inode(req->args.fallocate.inode_nr)) == NULL) {
+  	log_error("ext2_fallocate: -EINVAL");
+    replymsg(portid, msgid, -EINVAL, NULL, 0);
+	  return;
+  }
+
+  sc = fallocate_inode(inode, req->args.fallocate.offset, req->args.fallocate.length);
+  put_inode(inode);
+  commit_replymsg(portid, msgid, sc, NULL, 0);
+}
+
+
+/* @brief   Find the next data or hole in a file
+ *
+ * @param   req, message header received by getmsg.
+ *
+ * Implements SEEK_DATA and SEEK_HOLE, the resulting offset is returned in
+ * the reply.
+ */
+void ext2_seek(iorequest_t *req)
+{
+  ioreply_t reply = {0};
+  struct inode *inode;
+  off64_t offset;
+  int whence;
+  
+  whence = req->args.seek.whence;
+  
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+    replymsg(portid, msgid, -EINVAL, NULL, 0);
+    return;
+  }
+  
+  if ((inode = find_inode(req->args.seek.inode_nr)) == NULL) {
+  	log_error("ext2_seek: -EINVAL");
+    replymsg(portid, msgid, -EINVAL, NULL, 0);
+	  return;
+  }
+
+  // Blocks waiting for delayed allocation would otherwise look like holes
+  if ((offset = flush_delalloc(inode)) != 0) {
+    replymsg(portid, msgid, offset, NULL, 0);
+    return;
+  }
+  
+  offset = seek_data_hole(inode, req->args.seek.offset, whence);
+
+  if (offset < 0) {
+    replymsg(portid, msgid, offset, NULL, 0);
+    return;
+  }
+  
+  reply.args.seek.offset = offset;
+  replymsg(portid, msgid, 0, &reply, sizeof reply);
+}
+
@@ -14,11 +14,19 @@
  *
  * @param   req, message header received by getmsg.
  *
- * Release any resources of a previously opened/looked up file.
- * For extfs this shouldn't be applicable.
+ * Release any resources of a previously opened/looked up file. Blocks
+ * are allocated for data whose allocation was delayed and unused blocks
+ * preallocated for appending to the file are freed.
  */
 void ext2_close(iorequest_t *req)
 {
+  struct inode *inode;
+  
+  if ((inode = find_inode(req->args.close.inode_nr)) != NULL) {
+    flush_delalloc(inode);
+    discard_prealloc(inode);
+  }
+  
   replymsg(portid, msgid, 0, NULL, 0);
 }
 
@@ -94,7 +102,7 @@ void ext2_rename(iorequest_t *req)
   put_inode(dst_dir_inode);
   put_inode(src_dir_inode);
 
-  replymsg(portid, msgid, sc, NULL, 0);
+  commit_replymsg(portid, msgid, sc, NULL, 0);
 }
 
 
@@ -138,7 +146,7 @@ void ext2_mknod(iorequest_t *req)
 
 	// FIXME: TODO:  Return inode details in reply
 
-  replymsg(portid, msgid, 0, NULL, 0);  // FIXME: return reply
+  commit_replymsg(portid, msgid, 0, NULL, 0);  // FIXME: return reply
 }
 
 
@@ -182,13 +190,14 @@ void ext2_unlink(iorequest_t *req)
 	  inode->i_update |= CTIME;
 	  inode_markdirty(inode);
 	  
-	  // TODO: Remove file contents if i_links_count == 0, call truncate file.? 
+	  // If this was the last link, the file's blocks are freed in the
+	  // background once its last reference is released, see orphan.c
   }
 
   put_inode(inode);
   put_inode(dir_inode);
 
-  replymsg(portid, msgid, sc, NULL, 0);
+  commit_replymsg(portid, msgid, sc, NULL, 0);
 }
 
 
@@ -33,7 +33,7 @@ void ext2_chmod(iorequest_t *req)
   inode_markdirty(inode);
   put_inode(inode);
 
-  replymsg(portid, msgid, 0, NULL, 0);
+  commit_replymsg(portid, msgid, 0, NULL, 0);
 }
 
 
@@ -59,6 +59,6 @@ void ext2_chown(iorequest_t *req)
   inode_markdirty(inode);
   put_inode(inode);
 
-  replymsg(portid, msgid, 0, NULL, 0);
+  commit_replymsg(portid, msgid, 0, NULL, 0);
 }
 
@@ -0,0 +1,133 @@
+/* This file handles background reclamation of unlinked inodes.
+ *
+ * When the last link to an inode is removed and its last reference is
+ * released, its blocks are not freed straight away. The inode is pushed
+ * onto the orphan list, a singly linked list that starts at the
+ * superblock's s_last_orphan and continues through each orphan's i_dtime,
+ * as ext3 and e2fsck use it. Unlink can then reply as soon as the
+ * directory entry is gone.
+ *
+ * The main loop calls reclaim_orphans() while no messages are waiting. Each
+ * call shrinks the orphan at the head of the list by at most
+ * RECLAIM_SLICE_BLOCKS blocks and writes the new size back to the inode,
+ * so a crash part way through leaves a shorter orphan on the list that is
+ * picked up again on the next mount. Once an orphan is empty it is taken
+ * off the list and its inode freed.
+ *
+ * The orphan's inode-table block is written back before each superblock
+ * write that links it into or out of the list, and after each slice is
+ * freed, so that the list on disk never points at an inode whose link or
+ * size has not reached the disk. If the orphan cannot be loaded, because
+ * the inode cache is full, or cannot be truncated, reclamation backs off
+ * for ORPHAN_RETRY_SECS and tries the same orphan again.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include <time.h>
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Add an unlinked inode to the orphan list
+ *
+ * @param   inode, inode with no links and no references left
+ */
+void add_orphan(struct inode *inode)
+{
+  inode->odi.i_dtime = superblock.s_last_orphan;
+  inode->i_orphan = true;
+  inode_markdirty(inode);
+  sync_inode(inode);
+
+  superblock.s_last_orphan = inode->i_ino;
+  superblock_markdirty();
+}
+
+
+/* @brief   Check if there are orphans waiting to be reclaimed
+ *
+ * @return  true if the orphan list is not empty and not backing off
+ */
+bool orphans_pending(void)
+{
+  return (config.read_only == false && superblock.s_last_orphan != NO_INODE
+          && time(NULL) >= orphan_retry_time);
+}
+
+
+/* @brief   Perform one slice of orphan reclamation
+ *
+ * Called from the main loop when there are no messages waiting. The
+ * orphan at the head of the list is always the one worked on, so an inode
+ * is only ever removed from the head of the list. An orphan that is
+ * replaced at the head by a newer one is finished once the newer one is.
+ */
+void reclaim_orphans(void)
+{
+  struct inode *inode;
+  ino_t ino_nr;
+  off64_t size;
+  uint64_t slice;
+  int sc;
+
+  ino_nr = superblock.s_last_orphan;
+
+  if (ino_nr == NO_INODE) {
+    return;
+  }
+
+  if (ino_nr > superblock.s_inodes_count) {
+    log_warn("extfs: invalid orphan inode %u, dropping orphan list", (uint32_t)ino_nr);
+    superblock.s_last_orphan = NO_INODE;
+    write_superblock();
+    return;
+  }
+
+  if ((inode = get_inode(ino_nr)) == NULL) {
+    log_warn("extfs: can't get orphan inode %u, retrying later", (uint32_t)ino_nr);
+    orphan_retry_time = time(NULL) + ORPHAN_RETRY_SECS;
+    return;
+  }
+
+  inode->i_orphan = true;
+  
+  // The list is unlinked on disk first, a stale i_dtime in a linked inode is harmless
+  if (inode->odi.i_links_count != 0) {
+    log_warn("extfs: orphan inode %u is still linked", (uint32_t)ino_nr);
+    superblock.s_last_orphan = inode->odi.i_dtime;
+    write_superblock();
+    inode->odi.i_dtime = 0;
+    inode->i_orphan = false;
+    inode_markdirty(inode);
+    put_inode(inode);
+    return;
+  }
+
+  size = inode->odi.i_size;
+  slice = (uint64_t)RECLAIM_SLICE_BLOCKS * sb_block_size;
+  
+  if (size > 0) {
+    if ((sc = truncate_inode(inode, (size > slice) ? size - slice : 0)) != 0) {
+      log_warn("extfs: can't truncate orphan inode %u, sc:%d", (uint32_t)ino_nr, sc);
+      orphan_retry_time = time(NULL) + ORPHAN_RETRY_SECS;
+    }
+
+    sync_inode(inode);
+    put_inode(inode);
+    return;
+  }
+
+  // Only an empty orphan is freed, its size of zero is already on disk
+  sync_inode(inode);
+  superblock.s_last_orphan = inode->odi.i_dtime;
+  write_superblock();
+
+  inode->odi.i_dtime = time(NULL);
+  inode_markdirty(inode);
+  free_inode(inode);
+  put_inode(inode);
+}
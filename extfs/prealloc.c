@@ -0,0 +1,213 @@
+/* This file manages block allocation goals and preallocation windows.
+ *
+ * Each in-memory inode remembers the last block allocated to it, and the
+ * next block is used as the goal for its next allocation. A file that is
+ * being appended to also reserves a window of blocks following the ones
+ * it asked for. The window is only a reservation held in memory. Its
+ * blocks stay free in the block bitmap, so a crash cannot leak them, but
+ * the allocator treats the windows of cached inodes as allocated so that
+ * no other file is given them. Later appends take blocks from the window,
+ * setting their bits only as they are used, instead of searching the
+ * bitmap. The window doubles each time it is used up, so several files
+ * being appended to at once are laid out in increasingly large contiguous
+ * pieces rather than block by block.
+ *
+ * A window is dropped when the file is closed, when the inode is evicted
+ * from the inode cache and when the file is deleted. All windows are
+ * dropped if the allocator cannot otherwise find space.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Reset an inode's allocation goal and preallocation window
+ *
+ * @param   inode, inode that has been loaded into the inode cache
+ */
+void init_prealloc(struct inode *inode)
+{
+  inode->i_last_alloc = NO_BLOCK;
+  inode->i_prealloc_block = NO_BLOCK;
+  inode->i_prealloc_count = 0;
+  inode->i_prealloc_window = 0;
+}
+
+
+/* @brief   Allocate blocks for a file using its goal and preallocation window
+ *
+ * @param   inode, inode of file to allocate blocks for
+ * @param   position, offset in the file of the first block to allocate
+ * @param   count, maximum number of blocks to allocate
+ * @param   ret_count, returns the number of contiguous blocks allocated
+ * @return  first block allocated or NO_BLOCK if there is no free space
+ *
+ * If the goal is the start of the preallocation window the blocks are
+ * taken from it. Otherwise the window is released and the blocks are
+ * allocated from the bitmap. An allocation at the end of the file also
+ * reserves a new window after the blocks allocated.
+ */
+block_t alloc_file_blocks(struct inode *inode, off64_t position, uint32_t count, uint32_t *ret_count)
+{
+  block_t goal;
+  block_t block;
+  uint32_t block_pos;
+  uint32_t window;
+  uint32_t reserved;
+  uint32_t n;
+
+  block_pos = position / sb_block_size;
+  goal = NO_BLOCK;
+
+  if (inode->i_last_alloc != NO_BLOCK) {
+    goal = inode->i_last_alloc + 1;
+  } else if (block_pos > 0) {
+    goal = read_map_entry(inode, (off64_t)(block_pos - 1) * sb_block_size);
+
+    if (goal != NO_BLOCK) {
+      goal++;
+    }
+  }
+
+  if (inode->i_prealloc_count > 0 && inode->i_prealloc_block == goal) {
+    block = inode->i_prealloc_block;
+    n = claim_blocks(block, MIN(count, inode->i_prealloc_count));
+
+    if (n > 0) {
+      inode->i_prealloc_block += n;
+      inode->i_prealloc_count -= n;
+      inode->i_last_alloc = block + n - 1;
+      *ret_count = n;
+      return block;
+    }
+  }
+
+  discard_prealloc(inode);
+
+  // Only reserve a window for appends
+  window = 0;
+
+  if ((off64_t)block_pos * sb_block_size >= inode->odi.i_size) {
+    if (inode->i_prealloc_window == 0) {
+      window = prealloc_window_size(inode);
+    } else {
+      window = MIN(inode->i_prealloc_window * 2, MAX_PREALLOC_WINDOW);
+    }
+  }
+
+  block = alloc_reserve_blocks(inode, goal, count, window, &n, &reserved);
+
+  // The only free space left may be in other files' windows
+  if (block == NO_BLOCK) {
+    discard_all_prealloc();
+    block = alloc_reserve_blocks(inode, goal, count, 0, &n, &reserved);
+  }
+  
+  if (block == NO_BLOCK) {
+    *ret_count = 0;
+    return NO_BLOCK;
+  }
+
+  if (reserved > 0) {
+    inode->i_prealloc_block = block + n;
+    inode->i_prealloc_count = reserved;
+    inode->i_prealloc_window = window;
+  } else {
+    inode->i_prealloc_window = 0;
+  }
+
+  inode->i_last_alloc = block + n - 1;
+  *ret_count = n;
+  return block;
+}
+
+
+/* @brief   Get the initial preallocation window size for a file
+ *
+ * @param   inode, inode of file being appended to
+ * @return  number of blocks to reserve, from the superblock's
+ *          s_prealloc_blocks or s_prealloc_dir_blocks if set
+ */
+uint32_t prealloc_window_size(struct inode *inode)
+{
+  uint32_t window;
+
+  if (S_ISDIR(inode->odi.i_mode)) {
+    window = superblock.s_prealloc_dir_blocks;
+  } else {
+    window = superblock.s_prealloc_blocks;
+  }
+
+  if (window == 0) {
+    window = DEFAULT_PREALLOC_WINDOW;
+  }
+
+  return MIN(window, MAX_PREALLOC_WINDOW);
+}
+
+
+/* @brief   Release the unused blocks of an inode's preallocation window
+ *
+ * @param   inode, inode whose preallocation window is to be released
+ *
+ * The blocks were never set in the bitmap, so there is nothing to free.
+ */
+void discard_prealloc(struct inode *inode)
+{
+  inode->i_prealloc_block = NO_BLOCK;
+  inode->i_prealloc_count = 0;
+}
+
+
+/* @brief   Release the preallocation windows of every cached inode
+ *
+ */
+void discard_all_prealloc(void)
+{
+  for (int t = 0; t < NR_INODES; t++) {
+    if (inode_cache[t].i_ino != NO_ENTRY) {
+      discard_prealloc(&inode_cache[t]);
+    }
+  }
+}
+
+
+/* @brief   Set or clear the bits of preallocation windows in a block bitmap
+ *
+ * @param   group, group the bitmap belongs to
+ * @param   bitmap, contents of the group's block bitmap
+ * @param   set, true to set the bits of windows in the group so that they
+ *          are not allocated, false to clear them again
+ *
+ * The bits must be cleared again before the bitmap is released, they are
+ * never written to disk.
+ */
+void mask_prealloc(int group, uint32_t *bitmap, bool set)
+{
+  struct inode *inode;
+  block_t group_start;
+
+  group_start = superblock.s_first_data_block + group * superblock.s_blocks_per_group;
+
+  for (int t = 0; t < NR_INODES; t++) {
+    inode = &inode_cache[t];
+
+    if (inode->i_ino == NO_ENTRY || inode->i_prealloc_count == 0
+        || inode->i_prealloc_block < group_start
+        || inode->i_prealloc_block >= group_start + superblock.s_blocks_per_group) {
+      continue;
+    }
+
+    if (set) {
+      set_bits(bitmap, inode->i_prealloc_block - group_start, inode->i_prealloc_count);
+    } else {
+      clear_bits(bitmap, inode->i_prealloc_block - group_start, inode->i_prealloc_count);
+    }
+  }
+}
+
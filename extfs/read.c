@@ -28,6 +28,10 @@ ssize_t read_file(ino_t ino_nr, size_t nrbytes, off64_t position)
   size_t total_xfered;  // total bytes read
   size_t chunk_size;    // size of partial block of data we are currently reading
   struct inode *inode;  // inode of file to read from
+  struct file_cache_entry *fce;  // cached contents of a small file
+  uint32_t nblocks;     // number of whole blocks remaining to read
+  ssize_t run_size;     // bytes read by a coalesced read of a run of blocks
+  uint32_t min_blocks;  // shortest run to read directly from the device
   int res;              // result
 
 //  log_info("read_file:ino:%u, nrbytes:%u, position:%u %u", ino_nr, nrbytes, (uint32_t)(position>>32), (uint32_t)position);
@@ -44,14 +48,36 @@ ssize_t read_file(ino_t ino_nr, size_t nrbytes, off64_t position)
     file_size = MAX_FILE_POS;
   }
 
+  update_lookup_prefetch(inode, position);
+  
+  // Small files are served whole from the file cache
+  if ((fce = get_file_cache_entry(inode)) != NULL) {
+    run_size = read_file_cache(fce, nrbytes, position);
+    
+    if (run_size > 0) {
+      inode->i_update |= ATIME;
+      inode_markdirty(inode);
+    }
+    
+    return run_size;
+  }
+
+  // Direct I/O reads every clean block from the device, otherwise only
+  // runs of 2 or more blocks bypass the block cache.
+  min_blocks = is_direct_io(inode, position, nrbytes) ? 1 : 2;
+
+  if (min_blocks > 1) {
+    update_readahead(inode, position, nrbytes);
+  }
+  
   res = 0;  
   total_xfered = 0;
   
   while (total_xfered < nrbytes) {
 	  off = (unsigned int) (position % sb_block_size);
 	  chunk_size = sb_block_size - off;
-	  if (chunk_size > nrbytes) {
-		  chunk_size = nrbytes;
+	  if (chunk_size > nrbytes - total_xfered) {
+		  chunk_size = nrbytes - total_xfered;
     }
     
 	  if (position >= file_size) {
@@ -64,6 +90,40 @@ ssize_t read_file(ino_t ino_nr, size_t nrbytes, off64_t position)
 	    chunk_size = (int) bytes_left;
 	  }
 
+    // Report a hole, however many blocks it spans, with one descriptor
+    if (sparse_read) {
+      run_size = read_hole(inode, position, MIN(nrbytes - total_xfered, bytes_left), total_xfered);
+
+      if (run_size > 0) {
+        total_xfered += run_size;
+        position += run_size;
+        continue;
+      }
+    }
+
+    // Read whole blocks that are physically contiguous with a single read
+    // of the device. Blocks that have been read ahead are copied out of
+    // the block cache instead, but still sent with a single writemsg.
+    if (off == 0 && chunk_size == sb_block_size && S_ISREG(inode->odi.i_mode)) {
+      nblocks = MIN(nrbytes - total_xfered, bytes_left) / sb_block_size;
+
+      if (min_blocks > 1 && position / sb_block_size < inode->i_ra_fetched) {
+        nblocks = MIN(nblocks, inode->i_ra_fetched - position / sb_block_size);
+        run_size = read_cached_run(inode, position, nblocks, min_blocks, total_xfered);
+      } else {
+        run_size = read_run(inode, position, nblocks, min_blocks, total_xfered);
+      }
+      
+      if (run_size < 0) {
+        res = run_size;
+        break;
+      } else if (run_size > 0) {
+        total_xfered += run_size;
+        position += run_size;
+        continue;
+      }
+    }
+
 	  res = read_chunk(inode, position, off, chunk_size, total_xfered);
 
 	  if (res != 0) {
@@ -78,6 +138,11 @@ ssize_t read_file(ino_t ino_nr, size_t nrbytes, off64_t position)
   	return res;
   }
 
+  if (min_blocks > 1) {
+    start_readahead(inode);
+    start_indirect_prefetch(inode);
+  }
+  
   inode->i_update |= ATIME;
   inode_markdirty(inode);
   
@@ -103,16 +168,33 @@ ssize_t read_file(ino_t ino_nr, size_t nrbytes, off64_t position)
 int read_chunk(struct inode *inode, off64_t position, size_t off, size_t chunk_size, size_t msg_off)
 {
   struct buf *buf = NULL;
+  struct delalloc_block *db;
   block_t block;
   int sc = 0;
 
   block = read_map_entry(inode, position);
 
   if (block == NO_BLOCK) {
-	  return read_nonexistent_block(msg_off, chunk_size);
+    if ((db = delalloc_lookup(inode, position / sb_block_size)) == NULL) {
+  	  return read_nonexistent_block(msg_off, chunk_size);
+    }
+    
+    sc = writemsg(portid, msgid, db->data + off, chunk_size, msg_off);
+    
+    if (sc != chunk_size) {
+      log_error("read_chunk: -EIO, sc= %d", sc);
+      return -EIO;
+    }
+    
+    return 0;
   }
 
-  buf = get_block_readahead(cache, block);
+  // Preallocated blocks that have not been written read as zeroes
+  if (inode->i_nr_uninit > 0 && is_uninit_block(inode, position / sb_block_size)) {
+    return read_nonexistent_block(msg_off, chunk_size);
+  }
+  
+  buf = get_block(cache, block, BLK_READ);
   assert(buf != NULL);
   
   sc = writemsg(portid, msgid, (uint8_t *)buf->data+off, chunk_size, msg_off);
@@ -127,6 +209,143 @@ int read_chunk(struct inode *inode, off64_t position, size_t off, size_t chunk_s
 }
 
 
+/* @brief   Read a run of physically contiguous blocks with a single device read
+ *
+ * @param   inode, pointer to inode of file to read
+ * @param   position, block-aligned position within file to read from
+ * @param   nblocks, maximum number of whole blocks to read
+ * @param   min_blocks, shortest run worth reading from the device
+ * @param   msg_off, offset in message buffer
+ * @return  number of bytes read, 0 if the blocks at position are not suited
+ *          to a coalesced read or negative errno on failure
+ *
+ * The run is read straight from the block device into the coalesce buffer
+ * and delivered to the client with one writemsg. Holes, runs shorter than
+ * min_blocks and blocks that may be dirty in the block cache are left to
+ * read_chunk(), as are preallocated blocks that have not been written.
+ */
+ssize_t read_run(struct inode *inode, off64_t position, uint32_t nblocks,
+                 uint32_t min_blocks, size_t msg_off)
+{
+  block_t block;
+  uint32_t len;
+  size_t sz;
+  int sc;
+
+  if (nblocks < min_blocks) {
+    return 0;
+  }
+  
+  block = read_map_run(inode, position, &len);
+
+  if (block == NO_BLOCK) {
+    return 0;
+  }
+  
+  len = MIN(len, nblocks);
+  len = MIN(len, COALESCE_BUF_SZ / sb_block_size);
+  
+  for (uint32_t t = 0; t < len; t++) {
+    if (dirty_block_lookup(block + t) != NULL
+        || (inode->i_nr_uninit > 0 && is_uninit_block(inode, position / sb_block_size + t))) {
+      len = t;
+      break;
+    }
+  }
+
+  if (len < min_blocks) {
+    return 0;
+  }
+  
+  sz = len * sb_block_size;
+
+  if (lseek64(block_fd, (off64_t)block * sb_block_size, SEEK_SET) == -1) {
+    log_error("read_run: lseek -EIO");
+    return -EIO;
+  }
+
+  sc = read(block_fd, coalesce_buf, sz);
+
+  if (sc != sz) {
+    log_error("read_run: -EIO, sc= %d", sc);
+    return -EIO;
+  }
+  
+  sc = writemsg(portid, msgid, coalesce_buf, sz, msg_off);
+
+  if (sc != sz) {
+    log_error("read_run: writemsg -EIO, sc= %d", sc);
+    return -EIO;
+  }
+  
+  return sz;
+}
+
+
+/* @brief   Read a run of blocks through the block cache with a single writemsg
+ *
+ * @param   inode, pointer to inode of file to read
+ * @param   position, block-aligned position within file to read from
+ * @param   nblocks, maximum number of whole blocks to read
+ * @param   min_blocks, shortest run worth copying
+ * @param   msg_off, offset in message buffer
+ * @return  number of bytes read, 0 if the blocks at position are not suited
+ *          to a coalesced read or negative errno on failure
+ *
+ * Used for blocks that readahead has brought into the block cache. The
+ * blocks need not be physically contiguous. Each is copied from the cache
+ * into the coalesce buffer, which is delivered to the client in one go.
+ * The run stops at a hole, a delayed or a preallocated block, which are
+ * left to read_chunk().
+ */
+ssize_t read_cached_run(struct inode *inode, off64_t position, uint32_t nblocks,
+                        uint32_t min_blocks, size_t msg_off)
+{
+  struct buf *bp;
+  block_t block;
+  uint32_t block_pos;
+  uint32_t n;
+  size_t sz;
+  int sc;
+
+  nblocks = MIN(nblocks, COALESCE_BUF_SZ / sb_block_size);
+
+  if (nblocks < min_blocks) {
+    return 0;
+  }
+  
+  block_pos = position / sb_block_size;
+
+  for (n = 0; n < nblocks; n++) {
+    block = read_map_entry(inode, (off64_t)(block_pos + n) * sb_block_size);
+
+    if (block == NO_BLOCK
+        || (inode->i_nr_uninit > 0 && is_uninit_block(inode, block_pos + n))) {
+      break;
+    }
+
+    bp = get_block(cache, block, BLK_READ);
+    assert(bp != NULL);
+    memcpy(coalesce_buf + n * sb_block_size, bp->data, sb_block_size);
+    put_block(cache, bp);
+  }
+
+  if (n < min_blocks) {
+    return 0;
+  }
+
+  sz = n * sb_block_size;
+  sc = writemsg(portid, msgid, coalesce_buf, sz, msg_off);
+
+  if (sc != sz) {
+    log_error("read_cached_run: writemsg -EIO, sc= %d", sc);
+    return -EIO;
+  }
+  
+  return sz;
+}
+
+
 /* @brief   Write zeroes back to the kernel's VFS when reading a nonexistent block
  *
  * @param   off, offset within message buffer to write the zeroed bytes
@@ -138,6 +357,10 @@ int read_nonexistent_block(size_t msg_off, size_t chunk_size)
   size_t remaining = chunk_size;
   size_t nbytes_to_xfer;
   int sc;
+
+  if (sparse_read && enter_hole_desc(msg_off, chunk_size)) {
+    return 0;
+  }
  
   while (remaining > 0) {
     nbytes_to_xfer = (remaining < sizeof zero_block_data) ? remaining : sizeof zero_block_data;
@@ -157,3 +380,101 @@ int read_nonexistent_block(size_t msg_off, size_t chunk_size)
 }
 
 
+
+
+/* @brief   Skip over a hole in a file during a sparse read
+ *
+ * @param   inode, inode of file being read
+ * @param   position, position within the file to read from
+ * @param   nbytes, maximum number of bytes to skip
+ * @param   msg_off, offset in message buffer
+ * @return  number of bytes of hole reported to the client, 0 if position is
+ *          not in a hole or the hole cannot be reported
+ */
+ssize_t read_hole(struct inode *inode, off64_t position, size_t nbytes, size_t msg_off)
+{
+  block_t block;
+  uint32_t len;
+  size_t off;
+  size_t sz;
+
+  // Blocks waiting for delayed allocation look like holes in the map
+  if (inode->i_delalloc_count > 0) {
+    return 0;
+  }
+  
+  block = read_map_run(inode, position, &len);
+
+  if (block != NO_BLOCK || len == 0) {
+    return 0;
+  }
+
+  off = position % sb_block_size;
+  sz = MIN((off64_t)len * sb_block_size - off, nbytes);
+
+  if (enter_hole_desc(msg_off, sz) == false) {
+    return 0;
+  }
+
+  return sz;
+}
+
+
+/* @brief   Add a hole to the sparse read reply
+ *
+ * @param   msg_off, offset in message buffer of the start of the hole
+ * @param   len, length of the hole in bytes
+ * @return  true if the hole was recorded, false if the reply is full and
+ *          the zeroes must be sent to the client instead
+ *
+ * A hole that starts where the previous one ended extends it.
+ */
+bool enter_hole_desc(size_t msg_off, size_t len)
+{
+  struct hole_desc *hd;
+
+  if (nr_hole_descs > 0) {
+    hd = &hole_descs[nr_hole_descs - 1];
+
+    if (hd->offset + hd->length == msg_off) {
+      hd->length += len;
+      return true;
+    }
+  }
+
+  if (nr_hole_descs >= NR_HOLE_DESCS) {
+    return false;
+  }
+
+  hd = &hole_descs[nr_hole_descs++];
+  hd->offset = msg_off;
+  hd->length = len;
+  return true;
+}
+
+
+/* @brief   Determine if a request should bypass the block cache
+ *
+ * @param   inode, inode of file being read or written
+ * @param   position, position within the file of the request
+ * @param   nbytes, size of the request
+ * @return  true if direct I/O is enabled for the mount or for this file with
+ *          the EXT2_DAX_FL flag and the request is block-aligned and large enough
+ */
+bool is_direct_io(struct inode *inode, off64_t position, size_t nbytes)
+{
+  if (!S_ISREG(inode->odi.i_mode)) {
+    return false;
+  }
+  
+  if (config.direct_io == false && (inode->odi.i_flags & EXT2_DAX_FL) == 0) {
+    return false;
+  }
+  
+  if ((position % sb_block_size) != 0 || nbytes < config.direct_io_min_size) {
+    return false;
+  }
+  
+  return true;
+}
+
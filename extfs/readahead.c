@@ -0,0 +1,430 @@
+/* This file handles adaptive readahead of file blocks into the block cache.
+ *
+ * Each inode tracks where the last read finished. A read that starts where
+ * the previous one stopped is sequential and doubles the readahead window,
+ * up to config.max_readahead_blocks, which is 0 when readahead is disabled.
+ * A read anywhere else collapses the window so random access does not pay
+ * for blocks it never uses.
+ * Readahead follows the file's logical block map, so a fragmented file is
+ * read ahead in file order rather than in device order.
+ *
+ * Readahead is asynchronous. A read queues the window and replies to the
+ * client straight away, the queue is then worked on in small slices from
+ * the main loop whenever no messages are waiting.
+ *
+ * The indirect blocks that map a file are prefetched through the same
+ * queue. Once readahead is a configurable fraction of the way through the
+ * range mapped by one indirect block, the next indirect block and any
+ * parent indirect blocks it needs are read, so that a sequential reader
+ * does not stall on a metadata read each time it crosses into a new one.
+ *
+ * Looking up a regular file also queues a prefetch of its first blocks,
+ * as it is usually read straight after. Each directory counts how often a
+ * lookup in it is followed by a read from the start of the file, and
+ * prefetching stops in directories where it rarely is, so that unused
+ * blocks do not push hot metadata out of the small block cache.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Reset the access pattern state of an inode
+ *
+ * @param   inode, inode that has been loaded into the inode cache
+ */
+void init_readahead(struct inode *inode)
+{
+  inode->i_ra_next_pos = 0;
+  inode->i_ra_window = 0;
+  inode->i_ra_end = 0;
+  inode->i_ra_fetched = 0;
+  inode->i_ind_prefetched = 0;
+  inode->i_pf_dir = NO_INODE;
+  inode->i_pf_lookups = 0;
+  inode->i_pf_hits = 0;
+}
+
+
+/* @brief   Update an inode's access pattern for a read
+ *
+ * @param   inode, inode of file being read
+ * @param   position, position within the file the read started at
+ * @param   nbytes, number of bytes that were read
+ *
+ * Grows the readahead window on sequential access and collapses it on
+ * random access.
+ */
+void update_readahead(struct inode *inode, off64_t position, size_t nbytes)
+{
+  if (position == inode->i_ra_next_pos) {
+    if (inode->i_ra_window == 0) {
+      inode->i_ra_window = MIN(MIN_READAHEAD_WINDOW, config.max_readahead_blocks);
+    } else {
+      inode->i_ra_window = MIN(inode->i_ra_window * 2, config.max_readahead_blocks);
+    }
+  } else {
+    inode->i_ra_window = 0;
+    inode->i_ra_end = 0;
+    inode->i_ra_fetched = 0;
+  }
+
+  inode->i_ra_next_pos = position + nbytes;
+}
+
+
+/* @brief   Queue readahead of the blocks that follow the last read of a file
+ *
+ * @param   inode, inode of file being read
+ *
+ * Readahead is queued once less than half of the current window remains
+ * ahead of the reader, so a sequential reader normally finds its blocks
+ * in the cache.
+ */
+void start_readahead(struct inode *inode)
+{
+  uint32_t next_block;
+  uint32_t last_block;
+  uint32_t first;
+
+  if (inode->i_ra_window == 0 || inode->odi.i_size == 0) {
+    return;
+  }
+
+  next_block = inode->i_ra_next_pos / sb_block_size;
+  last_block = (inode->odi.i_size - 1) / sb_block_size;
+
+  if (inode->i_ra_end > next_block && inode->i_ra_end - next_block >= inode->i_ra_window / 2) {
+    return;
+  }
+
+  first = MAX(next_block, inode->i_ra_end);
+
+  if (first > last_block) {
+    return;
+  }
+
+  inode->i_ra_end = MIN(next_block + inode->i_ra_window, last_block + 1);
+  queue_readahead(inode, first, inode->i_ra_end - first);
+}
+
+
+/* @brief   Add a range of a file's blocks to the readahead queue
+ *
+ * @param   inode, inode of file to read ahead
+ * @param   first, first logical block to read
+ * @param   nblocks, number of logical blocks to read
+ *
+ * A range that follows on from the inode's existing request extends it.
+ * If the queue is full the next request due to be serviced is replaced.
+ */
+void queue_readahead(struct inode *inode, uint32_t first, uint32_t nblocks)
+{
+  struct readahead_req *rr;
+  struct readahead_req *free_rr = NULL;
+
+  for (int t = 0; t < NR_READAHEAD_REQS; t++) {
+    rr = &readahead_queue[t];
+
+    if (rr->nblocks == 0) {
+      if (free_rr == NULL) {
+        free_rr = rr;
+      }
+    } else if (rr->ino == inode->i_ino && !rr->indirect) {
+      if (rr->first + rr->nblocks == first) {
+        rr->nblocks += nblocks;
+      } else {
+        rr->first = first;
+        rr->nblocks = nblocks;
+      }
+      return;
+    }
+  }
+
+  if (free_rr == NULL) {
+    free_rr = &readahead_queue[readahead_next];
+  } else {
+    nr_readahead_reqs++;
+  }
+
+  free_rr->ino = inode->i_ino;
+  free_rr->first = first;
+  free_rr->nblocks = nblocks;
+  free_rr->indirect = false;
+}
+
+
+/* @brief   Queue a prefetch of the next indirect block of a file
+ *
+ * @param   inode, inode of file being read sequentially
+ *
+ * Looks at where readahead has reached. When that is more than
+ * config.indirect_prefetch_pct percent of the way through the direct
+ * blocks or the range of the current indirect block, a request to walk
+ * the map of the first block of the next range is queued. Walking the map
+ * reads the next indirect block and, for double and triple indirect
+ * ranges, its parents.
+ */
+void start_indirect_prefetch(struct inode *inode)
+{
+  uint32_t offs[4];
+  uint32_t frontier;
+  uint32_t next;
+  uint32_t nentries;
+  int depth;
+
+  if (inode->i_ra_window == 0 || inode->odi.i_size == 0) {
+    return;
+  }
+
+  frontier = MAX(inode->i_ra_next_pos / sb_block_size, inode->i_ra_end);
+  depth = calc_block_indirection_offsets((off64_t)frontier * sb_block_size, offs);
+
+  if (depth < 0) {
+    return;
+  }
+
+  nentries = (depth == 0) ? EXT2_NDIR_BLOCKS : sb_addr_in_block;
+
+  if (offs[depth] * 100 < nentries * config.indirect_prefetch_pct) {
+    return;
+  }
+
+  next = frontier - offs[depth] + nentries;
+
+  if (next <= inode->i_ind_prefetched
+      || (off64_t)next * sb_block_size >= inode->odi.i_size) {
+    return;
+  }
+
+  // Left unmarked if the queue is full, so it is tried again on a later read
+  if (queue_indirect_prefetch(inode, next)) {
+    inode->i_ind_prefetched = next;
+  }
+}
+
+
+/* @brief   Queue a read of the indirect blocks that map a logical block
+ *
+ * @param   inode, inode of file to prefetch indirect blocks of
+ * @param   first, logical block whose mapping is to be read
+ * @return  true if queued, false if the readahead queue is full
+ */
+bool queue_indirect_prefetch(struct inode *inode, uint32_t first)
+{
+  struct readahead_req *rr;
+
+  for (int t = 0; t < NR_READAHEAD_REQS; t++) {
+    rr = &readahead_queue[t];
+
+    if (rr->nblocks == 0) {
+      rr->ino = inode->i_ino;
+      rr->first = first;
+      rr->nblocks = 1;
+      rr->indirect = true;
+      nr_readahead_reqs++;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+/* @brief   Prefetch the start of a file that has just been looked up
+ *
+ * @param   dir_inode, directory the file was found in
+ * @param   inode, inode of the file that was found
+ *
+ * Queues readahead of the first config.lookup_prefetch_blocks blocks of a
+ * regular file, and its first indirect block if the file is larger than
+ * the direct blocks. Nothing is queued if the file is already being read
+ * or if fewer than half the recent lookups in the directory were followed
+ * by a read from the start of the file. The lookup is counted either way
+ * so that a directory can start prefetching again.
+ */
+void start_lookup_prefetch(struct inode *dir_inode, struct inode *inode)
+{
+  uint32_t nblocks;
+
+  if (config.lookup_prefetch_blocks == 0 || !S_ISREG(inode->odi.i_mode)
+      || inode->odi.i_size == 0) {
+    return;
+  }
+
+  if (dir_inode->i_pf_lookups >= LOOKUP_PREFETCH_DECAY) {
+    dir_inode->i_pf_lookups /= 2;
+    dir_inode->i_pf_hits /= 2;
+  }
+
+  dir_inode->i_pf_lookups++;
+  inode->i_pf_dir = dir_inode->i_ino;
+
+  if (dir_inode->i_pf_lookups > LOOKUP_PREFETCH_TRIAL
+      && dir_inode->i_pf_hits * 2 < dir_inode->i_pf_lookups) {
+    return;
+  }
+
+  if (inode->i_ra_end != 0 || inode->i_ra_next_pos != 0) {
+    return;
+  }
+
+  nblocks = (inode->odi.i_size + sb_block_size - 1) / sb_block_size;
+  nblocks = MIN(nblocks, config.lookup_prefetch_blocks);
+
+  inode->i_ra_end = nblocks;
+  queue_readahead(inode, 0, nblocks);
+
+  if (inode->odi.i_size > (off64_t)EXT2_NDIR_BLOCKS * sb_block_size) {
+    if (queue_indirect_prefetch(inode, EXT2_NDIR_BLOCKS)) {
+      inode->i_ind_prefetched = EXT2_NDIR_BLOCKS;
+    }
+  }
+}
+
+
+/* @brief   Record whether a looked up file was then read from the start
+ *
+ * @param   inode, inode of file being read
+ * @param   position, position the read starts at
+ *
+ * Only the first read after a lookup is counted.
+ */
+void update_lookup_prefetch(struct inode *inode, off64_t position)
+{
+  struct inode *dir_inode;
+
+  if (inode->i_pf_dir == NO_INODE) {
+    return;
+  }
+
+  if (position == 0 && (dir_inode = find_inode(inode->i_pf_dir)) != NULL) {
+    dir_inode->i_pf_hits++;
+  }
+
+  inode->i_pf_dir = NO_INODE;
+}
+
+
+/* @brief   Check if there is readahead waiting to be done
+ *
+ * @return  true if the readahead queue is not empty
+ */
+bool readahead_pending(void)
+{
+  return (nr_readahead_reqs > 0);
+}
+
+
+/* @brief   Perform one slice of queued readahead
+ *
+ * Called from the main loop when there are no messages waiting. Reads at
+ * most READAHEAD_SLICE_BLOCKS blocks so that a newly arrived message is
+ * not held up for long. Blocks that the client has already read itself
+ * since the request was queued are skipped, and requests for inodes no
+ * longer in the inode cache are dropped.
+ */
+void run_readahead(void)
+{
+  struct readahead_req *rr;
+  struct inode *inode;
+  uint32_t next_block;
+  uint32_t n;
+
+  while (nr_readahead_reqs > 0) {
+    rr = &readahead_queue[readahead_next];
+    readahead_next = (readahead_next + 1) % NR_READAHEAD_REQS;
+
+    if (rr->nblocks == 0) {
+      continue;
+    }
+
+    inode = find_inode(rr->ino);
+
+    if (inode != NULL && rr->indirect) {
+      read_map_run(inode, (off64_t)rr->first * sb_block_size, NULL);
+      rr->nblocks = 0;
+      nr_readahead_reqs--;
+      return;
+    }
+
+    if (inode != NULL) {
+      next_block = inode->i_ra_next_pos / sb_block_size;
+
+      if (rr->first < next_block) {
+        n = MIN(next_block - rr->first, rr->nblocks);
+        rr->first += n;
+        rr->nblocks -= n;
+      }
+    }
+
+    if (inode == NULL || rr->nblocks == 0) {
+      rr->nblocks = 0;
+      nr_readahead_reqs--;
+      continue;
+    }
+
+    n = MIN(rr->nblocks, READAHEAD_SLICE_BLOCKS);
+    readahead_blocks(inode, rr->first, n);
+
+    rr->first += n;
+    rr->nblocks -= n;
+    inode->i_ra_fetched = rr->first;
+
+    if (rr->nblocks == 0) {
+      nr_readahead_reqs--;
+    }
+
+    return;
+  }
+}
+
+
+/* @brief   Read a range of a file's logical blocks into the block cache
+ *
+ * @param   inode, inode of file to read ahead
+ * @param   first, first logical block to read
+ * @param   nblocks, number of logical blocks to read
+ *
+ * Each physically contiguous run is read with get_block_readahead() in
+ * chunks of nr_readahead_blocks, the remainder of a run block by block.
+ * Holes are skipped.
+ */
+void readahead_blocks(struct inode *inode, uint32_t first, uint32_t nblocks)
+{
+  struct buf *bp;
+  block_t block;
+  uint32_t len;
+  uint32_t t;
+
+  while (nblocks > 0) {
+    block = read_map_run(inode, (off64_t)first * sb_block_size, &len);
+
+    if (len == 0) {
+      break;
+    }
+
+    len = MIN(len, nblocks);
+
+    if (block != NO_BLOCK) {
+      for (t = 0; t + nr_readahead_blocks <= len; t += nr_readahead_blocks) {
+        bp = get_block_readahead(cache, block + t);
+        put_block(cache, bp);
+      }
+
+      for (; t < len; t++) {
+        bp = get_block(cache, block + t, BLK_READ);
+        put_block(cache, bp);
+      }
+    }
+
+    first += len;
+    nblocks -= len;
+  }
+}
+
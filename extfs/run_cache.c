@@ -0,0 +1,125 @@
+/* This file manages the per-inode cache of block runs.
+ *
+ * Each in-memory inode keeps a small table of contiguous runs of logical
+ * to physical block mappings that were found while walking the inode's
+ * indirect blocks. A lookup that hits in the table avoids reading the
+ * chain of indirect blocks again, so a sequential scan of a file only
+ * walks the indirect blocks once per run instead of once per block.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Lookup a logical block in an inode's run cache
+ *
+ * @param   inode, inode whose run cache is to be searched
+ * @param   block_pos, logical block number within the file
+ * @param   ret_len, if not NULL returns the number of blocks remaining in
+ *          the run, starting at block_pos
+ * @return  physical block number, NO_BLOCK if the run is a hole. If the block
+ *          is not in the cache NO_BLOCK is returned and ret_len is set to 0.
+ */
+block_t lookup_run_cache(struct inode *inode, uint32_t block_pos, uint32_t *ret_len)
+{
+  struct block_run *run;
+  uint32_t delta;
+
+  for (int t = 0; t < inode->i_nr_runs; t++) {
+    run = &inode->i_runs[t];
+
+    if (block_pos >= run->logical && block_pos - run->logical < run->length) {
+      delta = block_pos - run->logical;
+
+      if (ret_len != NULL) {
+        *ret_len = run->length - delta;
+      }
+
+      if (run->physical == NO_BLOCK) {
+        return NO_BLOCK;
+      }
+
+      return run->physical + delta;
+    }
+  }
+
+  if (ret_len != NULL) {
+    *ret_len = 0;
+  }
+
+  return NO_BLOCK;
+}
+
+
+/* @brief   Add a run of blocks to an inode's run cache
+ *
+ * @param   inode, inode whose run cache to add the run to
+ * @param   block_pos, first logical block of the run
+ * @param   block, first physical block of the run or NO_BLOCK for a hole
+ * @param   len, number of blocks in the run
+ *
+ * When the table is full the oldest entry is replaced.
+ */
+void enter_run_cache(struct inode *inode, uint32_t block_pos, block_t block, uint32_t len)
+{
+  struct block_run *run;
+
+  if (len == 0) {
+    return;
+  }
+
+  if (inode->i_nr_runs < NR_BLOCK_RUNS) {
+    run = &inode->i_runs[inode->i_nr_runs++];
+  } else {
+    run = &inode->i_runs[inode->i_next_run];
+    inode->i_next_run = (inode->i_next_run + 1) % NR_BLOCK_RUNS;
+  }
+
+  run->logical = block_pos;
+  run->physical = block;
+  run->length = len;
+}
+
+
+/* @brief   Remove any run containing a logical block from the run cache
+ *
+ * @param   inode, inode whose run cache is to be updated
+ * @param   block_pos, logical block whose mapping has changed
+ *
+ * Called whenever an entry in the inode's block map is added or removed.
+ */
+void invalidate_run_cache(struct inode *inode, uint32_t block_pos)
+{
+  struct block_run *run;
+  int t = 0;
+
+  while (t < inode->i_nr_runs) {
+    run = &inode->i_runs[t];
+
+    if (block_pos >= run->logical && block_pos - run->logical < run->length) {
+      inode->i_nr_runs--;
+      *run = inode->i_runs[inode->i_nr_runs];
+    } else {
+      t++;
+    }
+  }
+
+  inode->i_next_run = 0;
+}
+
+
+/* @brief   Discard all runs in an inode's run cache
+ *
+ * @param   inode, inode whose run cache is to be emptied
+ */
+void flush_run_cache(struct inode *inode)
+{
+  inode->i_nr_runs = 0;
+  inode->i_next_run = 0;
+}
+
@@ -109,6 +109,15 @@ int read_superblock(void)
   if (ondisk_group_descs == NULL) {
 	  panic("can't allocate group desc array");
   }
+
+  gdt_dirty_map = mmap(NULL, ((sb_group_desc_block_count + 31) / 32) * sizeof (uint32_t),
+                       PROT_READ | PROT_WRITE, 0, -1, 0);
+
+  if (gdt_dirty_map == NULL) {
+	  panic("can't allocate group desc dirty map");
+  }
+
+  group_descriptors_markclean();
   
   /* s_first_data_block (block number, where superblock is stored)
    * is 1 for 1Kb blocks and 0 for larger blocks.
@@ -155,8 +164,10 @@ int read_superblock(void)
 }
 
 
-/* @brief   Write the superblock and Group Descriptor Table from memory onto disk
+/* @brief   Write the superblock from memory onto disk
  *
+ * The group descriptor table is written separately by
+ * write_group_descriptors(), normally by the periodic flusher.
  */
 void write_superblock(void)
 {
@@ -173,21 +184,19 @@ void write_superblock(void)
   if (sz != SUPERBLOCK_SIZE) {
   	panic("ext2: failed to write complete superblock, sz:%d", sz);
   }
-  
-  if (sb_group_descriptors_dirty) {
-    copy_group_descriptors(ondisk_group_descs, group_descs, sb_groups_count);
 
-		log_info("write group descriptors");
+  sb_superblock_dirty = false;
+}
 
-    lseek64(block_fd, sb_gdt_position, SEEK_SET);
-    sz = write(block_fd, (char *)ondisk_group_descs, sb_groups_count * sizeof(struct group_desc));
 
-    if (sz != sb_groups_count * sizeof(struct group_desc)) {
-	    panic("can not read group descriptors");
-    }
-	  
-	  sb_group_descriptors_dirty = false;
-  }
+/* @brief   Mark the superblock as needing to be written
+ *
+ * It is written at the end of the current batch of messages, or by the
+ * periodic flusher.
+ */
+void superblock_markdirty(void)
+{
+  sb_superblock_dirty = true;
 }
 
 
@@ -231,6 +240,7 @@ void super_copy(struct superblock *dest, struct superblock *source)
   dest->s_feature_ro_compat = bswap4(be_cpu, source->s_feature_ro_compat);
   dest->s_algorithm_usage_bitmap  = bswap4(be_cpu, source->s_algorithm_usage_bitmap);
   dest->s_padding1                = bswap2(be_cpu, source->s_padding1);
+  dest->s_last_orphan             = bswap4(be_cpu, source->s_last_orphan);
   
   memcpy(dest->s_uuid, source->s_uuid, sizeof(dest->s_uuid));
   memcpy(dest->s_volume_name, source->s_volume_name, sizeof(dest->s_volume_name));
@@ -0,0 +1,160 @@
+/* This file limits the amount of dirty data a writer can build up.
+ *
+ * Dirty data is counted as the blocks in the dirty block table plus the
+ * buffers waiting for delayed allocation. Above the soft limit the main
+ * loop writes back the least recently dirtied blocks a slice at a time
+ * whenever there are no messages to handle. Above the hard limit writes
+ * are not handled at all. They are queued with their message ids and
+ * replied to once write back has brought the dirty data under the hard
+ * limit again. Reads and metadata operations carry on in the meantime
+ * without having to evict dirty blocks to find room in the block cache.
+ *
+ * Once a write has been queued all later writes are queued behind it, so
+ * that writes are still handled in the order they were received.
+ *
+ * Nothing can be written back once the dirty data is all delayed blocks
+ * that cannot be allocated. The queued writes are then failed with
+ * -ENOSPC rather than left waiting, and the main loop stops polling until
+ * a message arrives or the flush timer fires.
+ *
+ * Created (CheviotOS Filesystem Handler based)
+ *   December 2023 (Marven Gilhespie)
+ */
+
+#define LOG_LEVEL_WARN
+
+#include "ext2.h"
+#include "globals.h"
+
+
+/* @brief   Get the amount of dirty data
+ *
+ * @return  number of dirty and delayed allocation blocks
+ */
+uint32_t nr_dirty_data(void)
+{
+  return nr_dirty_blocks + nr_delalloc_reserved;
+}
+
+
+/* @brief   Check if there is write back or deferred writes to do
+ *
+ * @return  true if the main loop should poll and call run_writeback()
+ */
+bool writeback_pending(void)
+{
+  return nr_deferred_writes > 0 || nr_dirty_data() > config.dirty_soft_limit;
+}
+
+
+/* @brief   Write back one slice of dirty data and handle deferred writes
+ *
+ * @return  true if blocks were written back or deferred writes handled,
+ *          false if no progress was made
+ *
+ * Called by the main loop when there are no messages waiting.
+ */
+bool run_writeback(void)
+{
+  uint32_t n = 0;
+  uint32_t nr_deferred = nr_deferred_writes;
+
+  if (nr_dirty_data() > config.dirty_soft_limit) {
+    n = writeback_oldest(WRITEBACK_SLICE_BLOCKS);
+  }
+
+  if (n == 0 && nr_dirty_data() >= config.dirty_hard_limit) {
+    fail_deferred_writes(-ENOSPC);
+  }
+
+  run_deferred_writes(false);
+  return (n > 0 || nr_deferred_writes != nr_deferred);
+}
+
+
+/* @brief   Handle a write, or defer it if there is too much dirty data
+ *
+ * @param   req, message header received by getmsg.
+ *
+ * If the deferred write queue is full, dirty data is written back until
+ * the queued writes and this one can be handled.
+ */
+void throttle_write(iorequest_t *req)
+{
+  struct deferred_write *dw;
+
+  if (nr_deferred_writes == 0 && nr_dirty_data() < config.dirty_hard_limit) {
+    ext2_write(req);
+    return;
+  }
+
+  if (nr_deferred_writes == NR_DEFERRED_WRITES) {
+    run_deferred_writes(true);
+    ext2_write(req);
+    return;
+  }
+
+  dw = &deferred_writes[(deferred_write_head + nr_deferred_writes) % NR_DEFERRED_WRITES];
+  dw->msgid = msgid;
+  dw->req = *req;
+  nr_deferred_writes++;
+}
+
+
+/* @brief   Handle deferred writes in the order they were received
+ *
+ * @param   force, true to write back dirty data until all deferred writes
+ *          have been handled, false to stop at the hard limit
+ */
+void run_deferred_writes(bool force)
+{
+  struct deferred_write *dw;
+  msgid_t saved_msgid = msgid;
+
+  while (nr_deferred_writes > 0) {
+    if (nr_dirty_data() >= config.dirty_hard_limit) {
+      if (force == false) {
+        break;
+      }
+      
+      if (writeback_oldest(WRITEBACK_SLICE_BLOCKS) != 0) {
+        continue;
+      }
+
+      fail_deferred_writes(-ENOSPC);
+      break;
+    }
+
+    dw = &deferred_writes[deferred_write_head];
+    deferred_write_head = (deferred_write_head + 1) % NR_DEFERRED_WRITES;
+    nr_deferred_writes--;
+
+    // ext2_write() reads the data from, and replies to, the current message
+    msgid = dw->msgid;
+    ext2_write(&dw->req);
+  }
+
+  msgid = saved_msgid;
+}
+
+
+/* @brief   Fail every deferred write
+ *
+ * @param   sc, negative errno to reply with
+ *
+ * Called when the dirty data cannot be brought under the hard limit.
+ */
+void fail_deferred_writes(int sc)
+{
+  struct deferred_write *dw;
+
+  while (nr_deferred_writes > 0) {
+    dw = &deferred_writes[deferred_write_head];
+    deferred_write_head = (deferred_write_head + 1) % NR_DEFERRED_WRITES;
+    nr_deferred_writes--;
+
+    log_warn("extfs: can't write back dirty data, write failed:%d", sc);
+    replymsg(portid, dw->msgid, sc, NULL, 0);
+  }
+}
+
@@ -1,4 +1,8 @@
-/* This file handles truncating of files.
+/* This file handles truncating of files and punching holes in them.
+ *
+ * Both are built on delete_map_range() in block.c, which frees a range of
+ * a file's logical blocks in one walk over the block map. Partial blocks
+ * at the edges of the range are zeroed instead of freed.
  *
  * Created (CheviotOS Filesystem Handler based)
  *   December 2023 (Marven Gilhespie) 
@@ -12,9 +16,166 @@
 
 /* @brief   Truncate the contents of a inode, freeing blocks
  *
+ * @param   inode, inode of file to truncate
+ * @param   sz, new size of the file
+ * @return  0 on success, negative errno on failure
+ *
+ * If sz is larger than the current size the file is extended with a hole.
+ * Fast symbolic links hold their target in the block map, so their block
+ * map is left alone.
+ */
+int truncate_inode(struct inode *inode, off64_t sz)
+{
+  uint32_t first;
+  off64_t position;
+  
+  if (!S_ISREG(inode->odi.i_mode) && !S_ISDIR(inode->odi.i_mode) && !S_ISLNK(inode->odi.i_mode)) {
+    return -EINVAL;
+  }
+
+  if (sz < 0) {
+    return -EINVAL;
+  }
+  
+  if (sz > 0xFFFFFFFFLL) {
+    return -EFBIG;
+  }
+  
+  invalidate_file_cache(inode->i_ino);
+
+  if (S_ISLNK(inode->odi.i_mode) && inode->odi.i_blocks == 0) {
+    inode->odi.i_size = sz;
+    inode->i_update |= CTIME | MTIME;
+    inode_markdirty(inode);
+    return 0;
+  }
+
+  // First logical block that lies wholly past the new end of file
+  first = (sz + sb_block_size - 1) / sb_block_size;
+
+  discard_delalloc(inode, first, UINT32_MAX);
+  discard_prealloc(inode);
+  remove_uninit(inode, first, UINT32_MAX - first);
+  
+  if (sz < inode->odi.i_size) {
+    delete_map_range(inode, first, UINT64_MAX);
+    inode->i_last_alloc = NO_BLOCK;
+  }
+
+  // Bytes past the old or new end of file in the last block must read as zero
+  position = MIN(sz, (off64_t)inode->odi.i_size);
+
+  if ((position % sb_block_size) != 0) {
+    zero_block_range(inode, position, sb_block_size - position % sb_block_size);
+  }
+
+  inode->odi.i_size = sz;
+  inode->i_update |= CTIME | MTIME;
+  inode_markdirty(inode);
+  return 0;
+}
+
+
+/* @brief   Deallocate a range of a file, leaving a hole
+ *
+ * @param   inode, inode of regular file
+ * @param   offset, start of the range
+ * @param   length, length of the range
+ * @return  0 on success, negative errno on failure
+ *
+ * Blocks lying wholly inside the range are freed and the rest of the range
+ * is zeroed. The size of the file is not changed, so any part of the range
+ * past the end of file is ignored.
  */
-int truncate_inode(struct inode *inode, ssize_t sz)
+int punch_hole(struct inode *inode, off64_t offset, off64_t length)
 {
-  log_info("truncate_inode() ENOSYS ino_nr:%u, inode:%08x", (uint32_t)inode->i_ino, (uint32_t)inode);
-  return -ENOSYS;  // FIXME: extfs truncate_inode
+  off64_t end;
+  off64_t edge;
+  uint64_t first;
+  uint64_t last;
+
+  if (!S_ISREG(inode->odi.i_mode)) {
+    return -EINVAL;
+  }
+
+  if (offset < 0 || length <= 0) {
+    return -EINVAL;
+  }
+
+  end = MIN(offset + length, (off64_t)inode->odi.i_size);
+
+  if (offset >= end) {
+    return 0;
+  }
+
+  invalidate_file_cache(inode->i_ino);
+
+  // A block holding the end of file is wholly inside a range that reaches it
+  first = (offset + sb_block_size - 1) / sb_block_size;
+
+  if (end == inode->odi.i_size) {
+    last = (end + sb_block_size - 1) / sb_block_size;
+  } else {
+    last = end / sb_block_size;
+  }
+
+  if (first < last) {
+    discard_delalloc(inode, first, last);
+    remove_uninit(inode, first, last - first);
+    delete_map_range(inode, first, last);
+  }
+
+  // Zero the partial blocks at either edge of the range
+  if ((offset % sb_block_size) != 0) {
+    edge = MIN(end, (off64_t)first * sb_block_size);
+    zero_block_range(inode, offset, edge - offset);
+  } else {
+    edge = offset;
+  }
+
+  if (last * sb_block_size < end && edge < end) {
+    edge = MAX(edge, (off64_t)last * sb_block_size);
+    zero_block_range(inode, edge, end - edge);
+  }
+
+  inode->i_update |= CTIME | MTIME;
+  inode_markdirty(inode);
+  return 0;
+}
+
+
+/* @brief   Zero part of a block of a file
+ *
+ * @param   inode, inode of file
+ * @param   position, offset in the file to start zeroing from
+ * @param   len, number of bytes to zero, not crossing a block boundary
+ *
+ * Nothing is done if the block is not allocated.
+ */
+void zero_block_range(struct inode *inode, off64_t position, size_t len)
+{
+  struct delalloc_block *db;
+  struct buf *bp;
+  block_t block;
+  size_t off;
+
+  off = position % sb_block_size;
+
+  if ((db = delalloc_lookup(inode, position / sb_block_size)) != NULL) {
+    memset(db->data + off, 0, len);
+    return;
+  }
+
+  if ((block = read_map_entry(inode, position)) == NO_BLOCK) {
+    return;
+  }
+
+  if ((bp = get_block(cache, block, BLK_READ)) == NULL) {
+    panic("extfs: error getting block:%u", (uint32_t)block);
+  }
+
+  memset((uint8_t *)bp->data + off, 0, len);
+  block_markdirty(bp);
+  put_block(cache, bp);
+  dirty_block_enter(block);
 }
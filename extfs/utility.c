@@ -1,4 +1,5 @@
-/* This file contains utility functions for byte swapping.
+/* This file contains utility functions for byte swapping and for
+ * checking blocks of data.
  *
  * Created (CheviotOS Filesystem Handler based)
  *   December 2023 (Marven Gilhespie) 
@@ -9,6 +10,10 @@
 #include "ext2.h"
 #include "globals.h"
 
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 
 /* @brief   Determine's if we are running on a big-endian CPU
  *
@@ -50,3 +55,39 @@ uint32_t bswap4(bool swap, uint32_t x)
           | ((x & 0x00FF0000) >> 8) | ((x & 0xFF000000) >> 24);  
 }
 
+
+/* @brief   Check if a buffer contains only zero bytes
+ *
+ * @param   data, buffer to check, 16-byte aligned
+ * @param   len, length of the buffer, a multiple of 64 bytes
+ * @return  true if every byte is zero
+ *
+ * 64 bytes are ORed together per step, with NEON where it is available,
+ * and the loop stops at the first step with a non-zero byte.
+ */
+bool is_zero_block(const void *data, size_t len)
+{
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  const uint32_t *p = data;
+  uint32x4_t acc;
+
+  for (size_t t = 0; t < len; t += 64, p += 16) {
+    acc = vorrq_u32(vorrq_u32(vld1q_u32(p), vld1q_u32(p + 4)),
+                    vorrq_u32(vld1q_u32(p + 8), vld1q_u32(p + 12)));
+
+    if (vmaxvq_u32(acc) != 0) {
+      return false;
+    }
+  }
+#else
+  const uint64_t *p = data;
+
+  for (size_t t = 0; t < len; t += 64, p += 8) {
+    if ((p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7]) != 0) {
+      return false;
+    }
+  }
+#endif
+
+  return true;
+}
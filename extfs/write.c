@@ -28,6 +28,8 @@ ssize_t write_file(ino_t ino_nr, size_t nbytes, off64_t position)
   size_t total_xfered;    // total bytes written
   size_t chunk_size;      // size of partial block of data we are currently writing
   struct inode *inode;    // inode of file to write to
+  ssize_t run_size;       // bytes written by a direct write of a run of blocks
+  bool direct;            // bypass the block cache for whole blocks
   int sc;                 // result
 
   if ((inode = find_inode(ino_nr)) == NULL) {
@@ -46,6 +48,23 @@ ssize_t write_file(ino_t ino_nr, size_t nbytes, off64_t position)
     return -EFBIG;
   }
 
+  invalidate_file_cache(ino_nr);
+  
+  direct = is_direct_io(inode, position, nbytes);
+
+  // Direct writes go straight to disk so must not leave older data
+  // waiting for delayed allocation.
+  if (direct) {
+    if ((sc = flush_delalloc(inode)) != 0) {
+      return sc;
+    }
+  }
+  
+  // With zero detection blocks are only allocated once known to be non-zero
+  if (direct || (config.delalloc == false && config.zero_detect == false)) {
+    alloc_write_blocks(inode, position, nbytes);
+  }
+  
   sc = 0;
   total_xfered = 0;
   
@@ -57,6 +76,20 @@ ssize_t write_file(ino_t ino_nr, size_t nbytes, off64_t position)
       chunk_size = nbytes;
     }
     
+    if (direct && off == 0 && chunk_size == sb_block_size) {
+      run_size = write_run(inode, position, nbytes / sb_block_size, total_xfered);
+      
+      if (run_size < 0) {
+        sc = run_size;
+        break;
+      }
+      
+      nbytes -= run_size;
+      total_xfered += run_size;
+      position += run_size;
+      continue;
+    }
+    
     sc = write_chunk(inode, position, off, chunk_size, total_xfered);
 
     if (sc != 0) {
@@ -81,12 +114,72 @@ ssize_t write_file(ino_t ino_nr, size_t nbytes, off64_t position)
   
   inode->i_update |= CTIME | MTIME;
   inode_markdirty(inode);
-
-  write_inode(inode);
   return total_xfered;
 }
 
 
+/* @brief   Allocate contiguous runs of blocks for the holes a write fills
+ *
+ * @param   inode, inode of file being written
+ * @param   position, offset in file the write starts at
+ * @param   nbytes, number of bytes being written
+ *
+ * Only blocks that the write covers completely are allocated here, each
+ * hole in the range with as few runs as possible, starting next to the
+ * last block allocated to the file. Partially written blocks at either end are left
+ * to write_chunk() which clears them as they are allocated. Running out
+ * of space is not an error here, write_chunk() reports it for the first
+ * block that could not be allocated.
+ */
+void alloc_write_blocks(struct inode *inode, off64_t position, size_t nbytes)
+{
+  uint32_t block_pos;
+  uint32_t end_pos;
+  uint32_t len;
+  uint32_t count;
+  block_t block;
+  
+  block_pos = (position + sb_block_size - 1) / sb_block_size;
+  end_pos = (position + nbytes) / sb_block_size;
+
+  while (block_pos < end_pos) {
+    block = read_map_run(inode, (off64_t)block_pos * sb_block_size, &len);
+
+    if (len == 0) {
+      return;
+    }
+    
+    len = MIN(len, end_pos - block_pos);
+    
+    if (block != NO_BLOCK) {
+      block_pos += len;
+      continue;
+    }
+    
+    while (len > 0) {
+      block = alloc_file_blocks(inode, (off64_t)block_pos * sb_block_size, len, &count);
+      
+      if (block == NO_BLOCK) {
+        return;
+      }
+      
+      if (enter_map_run(inode, (off64_t)block_pos * sb_block_size, block, count) != 0) {
+        // Free the blocks that did not make it into the map
+        for (uint32_t t = 0; t < count; t++) {
+          if (read_map_entry(inode, (off64_t)(block_pos + t) * sb_block_size) != block + t) {
+            free_block(block + t);
+          }
+        }
+        return;
+      }
+      
+      block_pos += count;
+      len -= count;
+    }
+  }
+}
+
+
 /* @brief   Write all or part of a block
  *
  * @param   inode, pointer to inode for file to be rd/wr
@@ -104,16 +197,40 @@ int write_chunk(struct inode *inode, off64_t position, size_t off, size_t chunk_
   ino_t ino = NO_INODE;
   uint64_t ino_off = rounddown(position, sb_block_size);
   block_t block;
+  uint8_t *src = NULL;
   int sc = 0;
 
   ino = inode->i_ino;
+
+  // A whole block of zeroes is left as, or turned into, a hole. Otherwise
+  // the data has already been read into the coalesce buffer.
+  if (config.zero_detect && chunk_size == sb_block_size && S_ISREG(inode->odi.i_mode)) {
+    if ((sc = write_zero_block(inode, position, msg_off)) != 0) {
+      return (sc < 0) ? sc : 0;
+    }
+    
+    src = coalesce_buf;
+  }
+  
   block = read_map_entry(inode, position);
   
   if (block == NO_BLOCK) {
+    if ((sc = write_delalloc(inode, position, off, chunk_size, msg_off, src)) <= 0) {
+      return sc;
+    }
+    
     if ((buf = new_block(inode, position)) == NULL) {
       log_error("write_block failed, out of blocks");
       return -EIO;
     }
+    
+    block = read_map_entry(inode, position);
+  } else if (inode->i_nr_uninit > 0 && is_uninit_block(inode, position / sb_block_size)) {
+    // A preallocated block is cleared rather than read on its first write
+    buf = get_block(cache, block, BLK_CLEAR);
+    assert(buf != NULL);
+    memset(buf->data, 0, sb_block_size);
+    remove_uninit(inode, position / sb_block_size, 1);
   } else {
     if (chunk_size == sb_block_size) {
       buf = get_block(cache, block, BLK_CLEAR);
@@ -126,9 +243,16 @@ int write_chunk(struct inode *inode, off64_t position, size_t off, size_t chunk_
 
   assert(buf != NULL);
   
-  sc = readmsg(portid, msgid, (uint8_t *)buf->data+off, chunk_size, msg_off);
+  if (src != NULL) {
+    memcpy((uint8_t *)buf->data+off, src, chunk_size);
+    sc = chunk_size;
+  } else {
+    sc = readmsg(portid, msgid, (uint8_t *)buf->data+off, chunk_size, msg_off);
+  }
+  
   block_markdirty(buf);
   put_block(cache, buf);
+  dirty_block_enter(block);
   
   if (sc != chunk_size) {
     log_info("write_chunk readmsg returned:%d", sc);
@@ -138,3 +262,116 @@ int write_chunk(struct inode *inode, off64_t position, size_t off, size_t chunk_
   return 0;
 }
 
+
+/* @brief   Check if a whole block being written is all zeroes
+ *
+ * @param   inode, inode of file being written
+ * @param   position, block-aligned position within the file
+ * @param   msg_off, offset in message buffer
+ * @return  1 if the block was zeroes and is now a hole, 0 if it is not
+ *          zeroes, in which case its data is left in the coalesce buffer,
+ *          or negative errno on failure
+ *
+ * A zero block written to a hole is not allocated. One written over an
+ * allocated block frees the block, as does one written over a block
+ * waiting for delayed allocation.
+ */
+int write_zero_block(struct inode *inode, off64_t position, size_t msg_off)
+{
+  struct delalloc_block *db;
+  uint32_t block_pos;
+  int sc;
+
+  sc = readmsg(portid, msgid, coalesce_buf, sb_block_size, msg_off);
+
+  if (sc != sb_block_size) {
+    log_info("write_zero_block readmsg returned:%d", sc);
+    return -EIO;
+  }
+
+  if (!is_zero_block(coalesce_buf, sb_block_size)) {
+    return 0;
+  }
+
+  block_pos = position / sb_block_size;
+
+  if ((db = delalloc_lookup(inode, block_pos)) != NULL) {
+    delalloc_remove(inode, db);
+  }
+
+  if (read_map_entry(inode, position) != NO_BLOCK) {
+    remove_uninit(inode, block_pos, 1);
+    delete_map_range(inode, block_pos, block_pos + 1);
+  }
+
+  return 1;
+}
+
+
+/* @brief   Write a run of whole blocks directly to the device
+ *
+ * @param   inode, pointer to inode of file to write
+ * @param   position, block-aligned position within file to write to
+ * @param   nblocks, maximum number of whole blocks to write
+ * @param   msg_off, offset in message buffer
+ * @return  number of bytes written or negative errno on failure
+ *
+ * Any unmapped blocks are allocated first. The first physically contiguous
+ * run is then read from the client into the coalesce buffer and written to
+ * the device with a single write, bypassing the block cache. Copies of the
+ * blocks in the block cache, dirty or not, are discarded beforehand.
+ */
+ssize_t write_run(struct inode *inode, off64_t position, uint32_t nblocks, size_t msg_off)
+{
+  block_t block;
+  uint32_t len;
+  size_t sz;
+  int sc;
+
+  nblocks = MIN(nblocks, COALESCE_BUF_SZ / sb_block_size);
+  
+  for (uint32_t t = 0; t < nblocks; t++) {
+    if (map_new_block(inode, position + t * sb_block_size) == NO_BLOCK) {
+      if (t == 0) {
+        log_error("write_run failed, out of blocks");
+        return -ENOSPC;
+      }
+      
+      nblocks = t;
+      break;
+    }
+  }
+  
+  block = read_map_run(inode, position, &len);
+  len = MIN(len, nblocks);
+  sz = len * sb_block_size;
+
+  sc = readmsg(portid, msgid, coalesce_buf, sz, msg_off);
+
+  if (sc != sz) {
+    log_info("write_run readmsg returned:%d", sc);
+    return -EIO;
+  }
+  
+  if (lseek64(block_fd, (off64_t)block * sb_block_size, SEEK_SET) == -1) {
+    log_error("write_run: lseek -EIO");
+    return -EIO;
+  }
+
+  for (uint32_t t = 0; t < len; t++) {
+    invalidate_block(cache, block + t);
+    dirty_block_remove(block + t);
+  }
+
+  remove_uninit(inode, position / sb_block_size, len);
+
+  sc = write(block_fd, coalesce_buf, sz);
+
+  if (sc != sz) {
+    log_error("write_run: write -EIO, sc:%d", sc);
+    return -EIO;
+  }
+
+  return sz;
+}
+